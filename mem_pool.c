@@ -2,9 +2,22 @@
  * Created by Ivo Georgiev on 2/9/16.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE // for sched_getcpu()
+#include <sched.h>
+#endif
+
 #include <stdlib.h>
+#include <string.h> // for memcpy()
 #include <assert.h>
+#include <stdint.h> // for uint64_t
 #include <stdio.h> // for perror()
+#include <unistd.h> // for sysconf()
+#include <sys/mman.h> // for mmap()
+#include <time.h> // for clock_gettime()
+#ifdef MEM_POOL_THREAD_SAFE
+#include <pthread.h>
+#endif
 
 #include "mem_pool.h"
 
@@ -23,10 +36,48 @@ static const unsigned   MEM_POOL_STORE_EXPAND_FACTOR    = 2;
 static const unsigned   MEM_NODE_HEAP_INIT_CAPACITY     = 40;
 static const float      MEM_NODE_HEAP_FILL_FACTOR       = 0.75;
 static const unsigned   MEM_NODE_HEAP_EXPAND_FACTOR     = 2;
+static const unsigned   MEM_NODE_NIL                    = (unsigned) -1;
 
 static const unsigned   MEM_GAP_IX_INIT_CAPACITY        = 40;
 static const float      MEM_GAP_IX_FILL_FACTOR          = 0.75;
 static const unsigned   MEM_GAP_IX_EXPAND_FACTOR        = 2;
+static const unsigned   MEM_GAP_IX_NIL                  = (unsigned) -1;
+
+static const unsigned   MEM_ALLOC_IX_INIT_CAPACITY      = 64; // power of 2
+static const float      MEM_ALLOC_IX_FILL_FACTOR        = 0.75;
+static const unsigned   MEM_ALLOC_IX_EXPAND_FACTOR      = 2;
+
+// TLSF: each power of two (first level) is split into 2^SL_LOG2 linear
+// second-level classes; gaps smaller than MEM_TLSF_SL_COUNT are in fl 0
+// note: macros, since they size arrays
+#define MEM_TLSF_SL_LOG2    4
+#define MEM_TLSF_SL_COUNT   (1 << MEM_TLSF_SL_LOG2)
+#define MEM_TLSF_FL_COUNT   (64 - MEM_TLSF_SL_LOG2 + 1)
+
+// thread caches: one magazine per size class of whole granules, up to
+// MEM_CACHE_CLASSES granules, for up to MEM_CACHE_THREAD_POOLS pools
+// per thread
+static const size_t     MEM_CACHE_GRANULE               = 16;
+#define MEM_CACHE_CLASSES       16
+#define MEM_CACHE_MAGAZINE      32
+#define MEM_CACHE_THREAD_POOLS  8
+
+// set in a segment's cache_class entry while it sits in a magazine, so
+// that freeing it again is caught
+static const unsigned char MEM_CACHE_IN_MAGAZINE        = 0x80;
+
+// huge pages asked for with POOL_HUGE_PAGES; mappings are rounded up to
+// (and, without MAP_HUGETLB, aligned to) this size
+static const size_t     MEM_HUGE_PAGE_SIZE              = 2 * 1024 * 1024;
+
+// POOL_LAZY_COMMIT pools make at least this many pages accessible at a
+// time, so that small allocations don't take a system call each
+static const size_t     MEM_COMMIT_CHUNK_PAGES          = 16;
+
+// BUDDY blocks are MEM_BUDDY_MIN_BLOCK << order bytes; the smallest one
+// must hold the two free list links
+static const size_t     MEM_BUDDY_MIN_BLOCK             = 16;
+#define MEM_BUDDY_ORDERS    (64 - 4)
 
 
 
@@ -40,27 +91,132 @@ typedef struct _alloc {
     size_t size;
 } alloc_t, *alloc_pt;
 
+// note: the links are indexes into the node heap, not pointers, so the
+// heap can be realloc-ed without fixing them up
+// note: use _mem_node_mem()/_mem_node_size() and the setters rather than
+// the fields, since the compact layout has no alloc_record
+#ifdef MEM_POOL_COMPACT
+// compact layout (24 bytes): the segment is a 32-bit offset from pool.mem
+// and its size shares a word with the flags, which limits pools to 4GB
+typedef struct _node {
+    uint64_t size : 62;
+    uint64_t used : 1;
+    uint64_t allocated : 1;
+    uint32_t offset;
+    unsigned gap;              // gap_ix slot, valid while this is a gap
+    unsigned next, prev;       // doubly-linked list for gap deletion
+} node_t, *node_pt;
+#else
 typedef struct _node {
     alloc_t alloc_record;
-    unsigned used;
-    unsigned allocated;
-    struct _node *next, *prev; // doubly-linked list for gap deletion
+    unsigned used : 1;
+    unsigned allocated : 1;
+    unsigned gap;              // gap_ix slot, valid while this is a gap
+    unsigned next, prev;       // doubly-linked list for gap deletion
 } node_t, *node_pt;
+#endif
 
+// the gap index is an AVL tree keyed by (size, address), or by address
+// alone for FIRST_FIT and NEXT_FIT, whose entries live in the gap_ix
+// array and link to each other by index, so that the array can be
+// realloc-ed without fixing up the tree
 typedef struct _gap {
     size_t size;
-    node_pt node;
+    size_t max_size;        // largest gap in this subtree
+    unsigned node;          // index of the gap's node in the node heap
+    unsigned left, right;   // children, or next free slot (left) if unused
+    unsigned height;        // 0 for an unused slot, 1 for a leaf
 } gap_t, *gap_pt;
 
+// with the TLSF policy the gap_ix entries are not a tree but are kept
+// on one doubly-linked list per size class (left = prev, right = next),
+// and the bitmaps tell which lists are non-empty
+typedef struct _tlsf {
+    uint64_t fl_bitmap;
+    unsigned sl_bitmap[MEM_TLSF_FL_COUNT];
+    unsigned heads[MEM_TLSF_FL_COUNT][MEM_TLSF_SL_COUNT];
+} tlsf_t, *tlsf_pt;
+
+// a thread's cache for one pool: magazines of freed segments, which the
+// pool itself still counts as allocated
+typedef struct _cache {
+    struct _cache *next;    // the pool's list of thread caches
+    char *slots[MEM_CACHE_CLASSES][MEM_CACHE_MAGAZINE];
+    unsigned count[MEM_CACHE_CLASSES];
+    unsigned long hits, misses, flushes; // not yet added to the pool's
+} cache_t, *cache_pt;
+
+// a SLAB pool is count objects of stride bytes each, with one bit per
+// object set while it is allocated; the free objects are threaded into
+// a list through their first bytes, and objects from fresh up have never
+// been handed out
+typedef struct _slab {
+    size_t object_size;
+    size_t stride;          // object_size, but room for at least the link
+    unsigned count;
+    unsigned fresh;
+    unsigned free_head;     // MEM_NODE_NIL if none
+    uint64_t bitmap[];
+} slab_t, *slab_pt;
+
+// a BUDDY pool is cut into blocks of MEM_BUDDY_MIN_BLOCK << order bytes,
+// each aligned to its size from the start of the pool (in units of the
+// smallest block); the free blocks are on one list per order, linked
+// through their first bytes, and for each order the bitmap has a bit
+// per possible block that is set while a free block of that order
+// starts there, followed by the same again for allocated blocks
+// note: a pool that isn't a power of two units starts out as one block
+// per bit of its size, largest first
+typedef struct _buddy {
+    size_t units;           // pool size in smallest blocks
+    unsigned max_order;
+    uint64_t nonempty;      // bit k set if heads[k] isn't empty
+    char *heads[MEM_BUDDY_ORDERS];
+    size_t base[MEM_BUDDY_ORDERS]; // first bitmap word of each order
+    size_t words;           // bitmap words per half
+    uint64_t bitmap[];
+} buddy_t, *buddy_pt;
+
+typedef struct _buddy_link {
+    char *next, *prev;
+} buddy_link_t, *buddy_link_pt;
+
 typedef struct _pool_mgr {
     pool_t pool;
     node_pt node_heap;
     unsigned total_nodes;
     unsigned used_nodes;
+    unsigned free_nodes;    // returned nodes of the heap, linked through next
+    unsigned fresh_nodes;   // nodes below this have been handed out before
     gap_pt gap_ix;
     unsigned gap_ix_capacity;
+    unsigned gap_ix_root;   // root of the gap tree
+    unsigned gap_ix_free;   // head of the list of returned gap_ix slots
+    unsigned gap_ix_fresh;  // slots below this have been handed out before
+    tlsf_pt tlsf;           // size class lists, TLSF pools only
+    slab_pt slab;           // object bitmap, SLAB pools only
+    buddy_pt buddy;         // free lists and bitmaps, BUDDY pools only
+    char *rover;            // where the NEXT_FIT search resumes, or the ARENA top
+    unsigned *alloc_ix;     // node indexes of allocations, hashed by address
+    unsigned alloc_ix_capacity;
+    unsigned char *cache_class; // per granule, size class + 1 of cached segments
+    cache_pt caches;            // every thread's cache for this pool
+    cache_pt retired_caches;    // dropped by mem_pool_reset(), freed by mem_pool_close()
+    unsigned long cache_epoch;  // thread cache entries from other epochs are stale
+    size_t mapped_size;         // length of the pool.mem mapping, 0 if malloc-ed
+    size_t page_size;           // of the mapping
+    uint64_t *trimmed;          // per page, set while given back by mem_pool_trim()
+    uint64_t *reserved;         // per page, set while still PROT_NONE (POOL_LAZY_COMMIT)
+#ifdef MEM_POOL_THREAD_SAFE
+    pthread_mutex_t lock;   // guards everything above, pool.* included
+#endif
 } pool_mgr_t, *pool_mgr_pt;
 
+typedef struct _sharded_mgr {
+    sharded_pool_t sharded;
+    pool_pt *by_address;    // the shards sorted by pool.mem, to route frees
+} sharded_mgr_t, *sharded_mgr_pt;
+
 
 
 /***************************/
@@ -72,6 +228,25 @@ static pool_mgr_pt *pool_store = NULL; // an array of pointers, only expand
 static unsigned pool_store_size = 0;
 static unsigned pool_store_capacity = 0;
 
+#ifdef MEM_POOL_THREAD_SAFE
+// guards the three above; each pool has its own lock for the rest
+static pthread_mutex_t pool_store_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// bumped, under the store lock, for each new pool and whenever a pool
+// drops its thread caches
+static unsigned long pool_cache_epoch = 0;
+
+// the calling thread's caches
+// note: a pool may have been closed since, so check the epoch before
+// touching the cache
+static _Thread_local struct {
+    pool_mgr_pt pool;
+    unsigned long epoch;
+    cache_pt cache;
+} thread_caches[MEM_CACHE_THREAD_POOLS];
+static _Thread_local unsigned thread_caches_next = 0;
+
 
 
 /********************************************/
@@ -80,8 +255,16 @@ static unsigned pool_store_capacity = 0;
 /*                                          */
 /********************************************/
 static alloc_status _mem_resize_pool_store();
-static alloc_status _mem_resize_node_heap(pool_mgr_pt pool_mgr);
+static alloc_status _mem_resize_node_heap(pool_mgr_pt pool_mgr, unsigned extra);
 static alloc_status _mem_resize_gap_ix(pool_mgr_pt pool_mgr);
+static node_pt _mem_node(pool_mgr_pt pool_mgr, unsigned ix);
+static unsigned _mem_node_ix(pool_mgr_pt pool_mgr, node_pt node);
+static char *_mem_node_mem(pool_mgr_pt pool_mgr, const node_pt node);
+static void _mem_node_set_mem(pool_mgr_pt pool_mgr, node_pt node, char *mem);
+static size_t _mem_node_size(const node_pt node);
+static void _mem_node_set_size(node_pt node, size_t size);
+static node_pt _mem_get_node(pool_mgr_pt pool_mgr);
+static void _mem_put_node(pool_mgr_pt pool_mgr, node_pt node);
 static alloc_status
 _mem_add_to_gap_ix(pool_mgr_pt pool_mgr,
                    size_t size,
@@ -90,8 +273,67 @@ static alloc_status
 _mem_remove_from_gap_ix(pool_mgr_pt pool_mgr,
                         size_t size,
                         node_pt node);
-static alloc_status _mem_sort_gap_ix(pool_mgr_pt pool_mgr);
+static unsigned _mem_find_gap_ix(pool_mgr_pt pool_mgr, size_t size);
+static unsigned _mem_find_first_gap_ix(pool_mgr_pt pool_mgr, unsigned ix, size_t size);
+static unsigned _mem_find_next_gap_ix(pool_mgr_pt pool_mgr, size_t size);
+static alloc_status _mem_resize_alloc_ix(pool_mgr_pt pool_mgr, unsigned extra);
+static void _mem_add_to_alloc_ix(pool_mgr_pt pool_mgr, node_pt node);
+static void _mem_remove_from_alloc_ix(pool_mgr_pt pool_mgr, node_pt node);
+static node_pt _mem_find_alloc_ix(pool_mgr_pt pool_mgr, const char *mem);
+static unsigned _mem_tlsf_find(pool_mgr_pt pool_mgr, size_t size);
 static alloc_status _mem_invalidate_gap_ix(pool_mgr_pt pool_mgr);
+static void _mem_lock_store();
+static void _mem_unlock_store();
+static void _mem_lock_pool(pool_mgr_pt pool_mgr);
+static void _mem_unlock_pool(pool_mgr_pt pool_mgr);
+static pool_pt _mem_pool_open(size_t size, alloc_policy policy, unsigned flags);
+static pool_pt _mem_slab_open(size_t object_size, unsigned count);
+static pool_pt _mem_buddy_open(size_t size, unsigned flags);
+static void _mem_pool_register(pool_mgr_pt pool_mgr);
+static alloc_status _mem_map_pool(pool_mgr_pt pool_mgr, size_t size, unsigned flags);
+static alloc_status _mem_prefault_pool(pool_mgr_pt pool_mgr, size_t length, unsigned flags,
+                                       const struct timespec *start);
+static void _mem_unmap_pool(pool_mgr_pt pool_mgr);
+static int _mem_page_bit(const uint64_t *map, size_t p);
+static void _mem_decommit(pool_mgr_pt pool_mgr, char *mem, size_t size);
+static alloc_status _mem_commit(pool_mgr_pt pool_mgr, char *mem, size_t size);
+static alloc_status _mem_commit_reserved(pool_mgr_pt pool_mgr, size_t first, size_t end);
+static alloc_status _mem_pool_close(pool_pt pool);
+static alloc_status _mem_pool_closable(pool_mgr_pt manager);
+static void *_mem_new_alloc(pool_pt pool, size_t size);
+static void *_mem_alloc_from_gap(pool_mgr_pt pool_mgr, node_pt node, size_t size, size_t gap_size);
+static void *_mem_new_alloc_aligned(pool_mgr_pt pool_mgr, size_t size, size_t alignment);
+static size_t _mem_align_pad(const char *mem, size_t alignment);
+static unsigned _mem_find_aligned_gap_ix(pool_mgr_pt pool_mgr, unsigned ix, size_t size, size_t alignment);
+static alloc_status _mem_del_alloc(pool_pt pool, void *alloc);
+static void *_mem_realloc_in_place(pool_mgr_pt pool_mgr, void *alloc, size_t size, size_t *old_size);
+static cache_pt _mem_thread_cache(pool_mgr_pt pool_mgr, int create);
+static void _mem_cache_fold_stats(pool_mgr_pt pool_mgr, cache_pt cache);
+static void *_mem_cache_alloc(pool_mgr_pt pool_mgr, size_t size);
+static alloc_status _mem_cache_free(pool_mgr_pt pool_mgr, void *alloc);
+static void *_mem_cache_pop(pool_mgr_pt pool_mgr, cache_pt cache, unsigned cls);
+static void _mem_cache_flush_class(pool_mgr_pt pool_mgr, cache_pt cache, unsigned cls, unsigned n);
+static void _mem_cache_drain(pool_mgr_pt pool_mgr, cache_pt cache);
+static void _mem_coalesce_gap(pool_mgr_pt pool_mgr, node_pt node);
+static void _mem_arena_set_top(pool_mgr_pt pool_mgr, char *top, unsigned num_allocs);
+static void *_mem_arena_alloc(pool_mgr_pt pool_mgr, size_t size);
+static alloc_status _mem_arena_free(pool_mgr_pt pool_mgr, void *alloc);
+static int _mem_slab_bit(slab_pt slab, long i);
+static void *_mem_slab_alloc(pool_mgr_pt pool_mgr, size_t size);
+static alloc_status _mem_slab_free(pool_mgr_pt pool_mgr, void *alloc);
+static void _mem_slab_reset(pool_mgr_pt pool_mgr);
+static int _mem_buddy_bit(buddy_pt buddy, int allocated, unsigned order, size_t unit);
+static void _mem_buddy_flip(buddy_pt buddy, int allocated, unsigned order, size_t unit);
+static unsigned _mem_buddy_order(buddy_pt buddy, size_t unit, int *allocated);
+static int _mem_buddy_is_free(buddy_pt buddy, size_t unit);
+static alloc_status _mem_buddy_push(pool_mgr_pt pool_mgr, unsigned order, size_t unit);
+static void _mem_buddy_unlink(pool_mgr_pt pool_mgr, unsigned order, size_t unit);
+static void *_mem_buddy_alloc(pool_mgr_pt pool_mgr, size_t size);
+static alloc_status _mem_buddy_free(pool_mgr_pt pool_mgr, void *alloc);
+static void *_mem_buddy_resize(pool_mgr_pt pool_mgr, void *alloc, size_t size, size_t *old_size);
+static alloc_status _mem_buddy_reset(pool_mgr_pt pool_mgr);
+static unsigned _mem_shard_ix(sharded_mgr_pt sharded_mgr);
+static pool_pt _mem_find_shard(sharded_mgr_pt sharded_mgr, const char *mem);
 
 // FOR DEBUGGING PURPOSES ONLY
 void nodeReport(pool_pt pool) { /*
@@ -108,13 +350,13 @@ void nodeReport(pool_pt pool) { /*
         printf("Is allocated: ");
         printf("%u\n", nodePtr->allocated);
         printf("Space allocated: ");
-        printf("%d\n", (int)nodePtr->alloc_record.size);
+        printf("%d\n", (int)_mem_node_size(nodePtr));
         printf("Prev node: ");
-        printf("%p\n", nodePtr->prev);
+        printf("%u\n", nodePtr->prev);
         printf("Next node: ");
-        printf("%p\n", nodePtr->next);
+        printf("%u\n", nodePtr->next);
         printf("---------------------------\n");
-        nodePtr = nodePtr->next;
+        nodePtr = _mem_node(managerPtr, nodePtr->next);
     } */
 
 }
@@ -127,7 +369,7 @@ void gapReport(pool_mgr_pt managerPtr) {
     printf("***************************\n");
     for (int i = 0; i < managerPtr->pool.num_gaps; i++) {
         printf("Address: ");
-        printf("%zp\n", managerPtr->gap_ix[i].node);
+        printf("%u\n", managerPtr->gap_ix[i].node);
         printf("Size: ");
         printf("%zu\n", managerPtr->gap_ix[i].size);
         printf("***************************\n");
@@ -147,6 +389,9 @@ alloc_status mem_init() {
     // allocate the pool store with initial capacity
     // note: holds pointers only, other functions to allocate/deallocate
     int i;
+    alloc_status status = ALLOC_CALLED_AGAIN;
+
+    _mem_lock_store();
     if (pool_store == NULL) {
 
         pool_store = malloc(MEM_POOL_STORE_INIT_CAPACITY * sizeof(pool_mgr_pt));
@@ -156,20 +401,21 @@ alloc_status mem_init() {
         {
             pool_store[i] = NULL;
         }
-        return ALLOC_OK;
+        status = ALLOC_OK;
     }
+    _mem_unlock_store();
 
-    else
-    {
-        return ALLOC_CALLED_AGAIN;
-    }
+    return status;
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////////
 alloc_status mem_free() {
     int i;
+    alloc_status status = ALLOC_CALLED_AGAIN;
 
+    _mem_lock_store();
 
     if (pool_store == NULL){
+        _mem_unlock_store();
         return ALLOC_CALLED_AGAIN;
     }
     // ensure that it's called only once for each mem_init
@@ -183,6 +429,9 @@ alloc_status mem_free() {
         {
             if (pool_store[i]&& pool_store[i] != NULL)
             {
+#ifdef MEM_POOL_THREAD_SAFE
+                pthread_mutex_destroy(&pool_store[i]->lock);
+#endif
                 free(pool_store[i]);
                 pool_store[i] = NULL;
             }
@@ -200,27 +449,71 @@ alloc_status mem_free() {
         }
 
         pool_store = NULL;
-        return ALLOC_OK;
+        status = ALLOC_OK;
 
     }
-    else
-    {
-        return ALLOC_CALLED_AGAIN;
-    }
+    _mem_unlock_store();
 
-    return ALLOC_FAIL;
+    return status;
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////////
 pool_pt mem_pool_open(size_t size, alloc_policy policy) {
+    _mem_lock_store();
+    pool_pt pool = _mem_pool_open(size, policy, POOL_DEFAULT);
+    _mem_unlock_store();
+
+    return pool;
+}
+
+// Opens a pool like mem_pool_open(), with the pool memory obtained the
+// way flags (POOL_* values or-ed together) ask
+// POOL_MMAP maps the pool anonymously instead of malloc-ing it, and
+// POOL_HUGE_PAGES also asks for huge pages: MAP_HUGETLB if the system
+// has some reserved, else transparent huge pages on a mapping aligned to
+// a huge page. POOL_LAZY_COMMIT only reserves the address range and
+// makes pages usable as allocations are carved out of them, so a pool
+// can be opened far bigger than it is expected to get; pool.committed_size
+// tracks how much of it is usable so far. POOL_PREFAULT faults every
+// page in while opening (MAP_POPULATE, or touching each page) so that
+// allocations never take a page fault, and POOL_LOCK also mlock()s the
+// memory so it stays resident, failing the open if it can't (e.g. over
+// RLIMIT_MEMLOCK); pool.prefault_ns is what that cost. Both imply
+// POOL_MMAP and override POOL_LAZY_COMMIT. pool.flags tells what was
+// actually obtained.
+pool_pt mem_pool_open_flags(size_t size, alloc_policy policy, unsigned flags) {
+    _mem_lock_store();
+    pool_pt pool = _mem_pool_open(size, policy, flags);
+    _mem_unlock_store();
+
+    return pool;
+}
+
+// called with the store locked
+static pool_pt _mem_pool_open(size_t size, alloc_policy policy, unsigned flags) {
     alloc_status status;
 
     // make sure there the pool store is allocated
 
-    if (pool_store == NULL)
+    if (pool_store == NULL || policy == SLAB)
     {
         return NULL;
     }
 
+    // buddy pools have no nodes either, just like slabs
+    if (policy == BUDDY)
+    {
+        return _mem_buddy_open(size, flags);
+    }
+
+#ifdef MEM_POOL_COMPACT
+    // compact nodes store 32-bit offsets into the pool
+    if (size > UINT32_MAX)
+    {
+        printf("pool size %lu too large for compact nodes\n", (unsigned long) size);
+        return NULL;
+    }
+#endif
+
     // expand the pool store, if necessary
 
     _mem_resize_pool_store();
@@ -228,33 +521,30 @@ pool_pt mem_pool_open(size_t size, alloc_policy policy) {
 
     // allocate a new mem pool mgr
     // check success, on error return null
-    int i;
-
     pool_mgr_pt newPool = malloc(sizeof(pool_mgr_t));
 
+    if (newPool == NULL)
+    {
+        return NULL;
+    }
+
 
     // allocate a new node heap
     // check success, on error deallocate mgr/pool and return null
+    // note: nodes and gap slots are set up when first handed out, so
+    // neither array needs an init pass here
 
     newPool->node_heap = malloc(MEM_NODE_HEAP_INIT_CAPACITY*sizeof(node_t));
 
     if (newPool->node_heap == NULL)
     {
-        free(pool_store[pool_store_size]);
+        free(newPool);
         return NULL;
     }
 
-
-    for (i = 0; i < MEM_NODE_HEAP_INIT_CAPACITY; i++)
-    {
-        newPool->node_heap[i].next = NULL;
-        newPool->node_heap[i].prev = NULL;
-        newPool->node_heap[i].allocated = 0;
-        newPool->node_heap[i].used = 0;
-        newPool->node_heap[i].alloc_record.size = 0;
-        newPool->node_heap[i].alloc_record.mem = NULL;
-    }
     newPool->total_nodes = MEM_NODE_HEAP_INIT_CAPACITY;
+    newPool->free_nodes = MEM_NODE_NIL;
+    newPool->fresh_nodes = 0;
 
 
     // allocate a new gap index
@@ -264,75 +554,239 @@ pool_pt mem_pool_open(size_t size, alloc_policy policy) {
 
     if (newPool->gap_ix == NULL)
     {
-        if (newPool->node_heap)
+        free(newPool->node_heap);
+        free(newPool);
+        return NULL;
+    }
+
+    newPool->gap_ix_capacity = MEM_GAP_IX_INIT_CAPACITY;
+    newPool->gap_ix_root = MEM_GAP_IX_NIL;
+    newPool->gap_ix_free = MEM_GAP_IX_NIL;
+    newPool->gap_ix_fresh = 0;
+
+    // allocate the allocation index
+    newPool->alloc_ix = malloc(MEM_ALLOC_IX_INIT_CAPACITY * sizeof(unsigned));
+
+    if (newPool->alloc_ix == NULL)
+    {
+        free(newPool->node_heap);
+        free(newPool->gap_ix);
+        free(newPool);
+        return NULL;
+    }
+
+    // MEM_NODE_NIL is all ones, so the empty table is a single memset
+    memset(newPool->alloc_ix, 0xff, MEM_ALLOC_IX_INIT_CAPACITY * sizeof(unsigned));
+    newPool->alloc_ix_capacity = MEM_ALLOC_IX_INIT_CAPACITY;
+
+    // allocate the size class lists for a TLSF pool
+    newPool->tlsf = NULL;
+    if (policy == TLSF)
+    {
+        newPool->tlsf = malloc(sizeof(tlsf_t));
+
+        if (newPool->tlsf == NULL)
         {
             free(newPool->node_heap);
-        }
-        if(newPool->gap_ix)
-        {
             free(newPool->gap_ix);
+            free(newPool->alloc_ix);
+            free(newPool);
+            return NULL;
         }
-        free(pool_store[pool_store_size]);
-        return NULL;
-    }
 
-    for (i = 0; i < MEM_GAP_IX_INIT_CAPACITY; i++)
-    {
-        newPool->gap_ix[i].node = (node_pt)malloc(sizeof(node_t));
-        newPool->gap_ix[i].node->prev = NULL;
-        newPool->gap_ix[i].node->next = NULL;
-        newPool->gap_ix[i].node->alloc_record.size = 0;
-        newPool->gap_ix[i].node->alloc_record.mem= NULL;
-        newPool->gap_ix[i].node->used = 0;
-        newPool->gap_ix[i].node->allocated= 0;
-        newPool->gap_ix[i].size = 0;
+        newPool->tlsf->fl_bitmap = 0;
+        memset(newPool->tlsf->sl_bitmap, 0, sizeof(newPool->tlsf->sl_bitmap));
+        memset(newPool->tlsf->heads, 0xff, sizeof(newPool->tlsf->heads));
     }
-    newPool->gap_ix_capacity = MEM_GAP_IX_INIT_CAPACITY;
 
 
 
     // assign all the pointers and update meta data:
     //   initialize top node of node heap
 
-    newPool->used_nodes= 1;
+    newPool->used_nodes= 0;
 
-    newPool->node_heap->alloc_record.mem = malloc(size);
+    // the top node is always the first one on the free list
+    _mem_get_node(newPool);
 
-    if (newPool->node_heap->alloc_record.mem == NULL)
+    // get the pool memory itself
+    // check success, on error deallocate everything and return null
+    if (_mem_map_pool(newPool, size, flags) != ALLOC_OK)
     {
-        newPool->node_heap->alloc_record.mem = realloc(newPool->node_heap->alloc_record.mem,size);
-
+        free(newPool->node_heap);
+        free(newPool->gap_ix);
+        free(newPool->alloc_ix);
+        free(newPool->tlsf);
+        free(newPool);
+        return NULL;
     }
 
-    newPool->node_heap->alloc_record.size = size;
+    _mem_node_set_mem(newPool, newPool->node_heap, newPool->pool.mem);
+    _mem_node_set_size(newPool->node_heap, size);
     newPool->node_heap->allocated = 0;
     newPool->node_heap->used = 1;
 
 
-    //   initialize top node of gap index
-    newPool->gap_ix[0].node = newPool->node_heap;
-    newPool->gap_ix[0].size = size;
-
     //   initialize pool mgr
 
-    newPool->pool.mem = newPool->node_heap->alloc_record.mem;// address via &??
+    newPool->rover = newPool->pool.mem;
     newPool->pool.policy = policy;
     newPool->pool.total_size = size;
     newPool->pool.alloc_size = 0;//????
     newPool->pool.num_allocs = 0;
-    newPool->pool.num_gaps = 1;// was 1???
+    newPool->pool.num_gaps = 0; // _mem_add_to_gap_ix() counts the first gap
+    newPool->pool.cache_hits = 0;
+    newPool->pool.cache_misses = 0;
+    newPool->pool.cache_flushes = 0;
+    newPool->cache_class = NULL;
+    newPool->caches = NULL;
+    newPool->retired_caches = NULL;
+    newPool->cache_epoch = ++pool_cache_epoch;
+    newPool->slab = NULL;
+    newPool->buddy = NULL;
+
+    //   initialize top node of gap index
+    _mem_add_to_gap_ix(newPool, size, newPool->node_heap);
 
     //   link pool mgr to pool store
-    pool_store[pool_store_size] = newPool;
+    _mem_pool_register(newPool);
 
-    pool_store_size++;
     // return the address of the mgr, cast to (pool_pt)
 
     return ((pool_pt)(newPool));//((pool_pt)(pool_store[pool_store_size]));
 
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////////
+// Opens a SLAB pool of count objects of object_size bytes each
+// Every allocation is one object (requests up to object_size bytes);
+// allocating and freeing are O(1) and the only per-object metadata is
+// one bit.
+pool_pt mem_slab_open(size_t object_size, unsigned count) {
+    _mem_lock_store();
+    pool_pt pool = _mem_slab_open(object_size, count);
+    _mem_unlock_store();
+
+    return pool;
+}
+
+// called with the store locked
+static pool_pt _mem_slab_open(size_t object_size, unsigned count) {
+    // the free list links are object indexes, stored in the free objects
+    size_t stride = (object_size < sizeof(unsigned)) ? sizeof(unsigned) : object_size;
+
+    if (pool_store == NULL || object_size == 0 || count == 0 || count == MEM_NODE_NIL
+        || stride > SIZE_MAX / count)
+    {
+        return NULL;
+    }
+
+    _mem_resize_pool_store();
+
+    // none of the node heap or indexes, those stay NULL
+    pool_mgr_pt newPool = calloc(1, sizeof(pool_mgr_t));
+    if (newPool == NULL)
+    {
+        return NULL;
+    }
+
+    newPool->slab = calloc(1, sizeof(slab_t) + (count + 63) / 64 * sizeof(uint64_t));
+    if (newPool->slab == NULL || _mem_map_pool(newPool, stride * count, POOL_DEFAULT) != ALLOC_OK)
+    {
+        free(newPool->slab);
+        free(newPool);
+        return NULL;
+    }
+
+    newPool->slab->object_size = object_size;
+    newPool->slab->stride = stride;
+    newPool->slab->count = count;
+    newPool->slab->fresh = 0;
+    newPool->slab->free_head = MEM_NODE_NIL;
+
+    newPool->rover = newPool->pool.mem;
+    newPool->pool.policy = SLAB;
+    newPool->pool.total_size = stride * count;
+    newPool->pool.num_gaps = 1;
+    newPool->cache_epoch = ++pool_cache_epoch;
+
+    _mem_pool_register(newPool);
+
+    return (pool_pt) newPool;
+}
+
+// called with the store locked
+// note: the pool is size rounded down to whole smallest blocks
+static pool_pt _mem_buddy_open(size_t size, unsigned flags) {
+    size_t units = size / MEM_BUDDY_MIN_BLOCK;
+    size_t words = 0;
+    unsigned max_order = 0;
+    unsigned k;
+
+    if (units == 0)
+    {
+        return NULL;
+    }
+
+    while ((units >> max_order) > 1)
+        max_order++;
+    for (k = 0; k <= max_order; k++)
+        words += ((units >> k) + 63) / 64;
+
+    _mem_resize_pool_store();
+
+    pool_mgr_pt newPool = calloc(1, sizeof(pool_mgr_t));
+    if (newPool == NULL)
+    {
+        return NULL;
+    }
+
+    newPool->buddy = calloc(1, sizeof(buddy_t) + 2 * words * sizeof(uint64_t));
+    if (newPool->buddy == NULL || _mem_map_pool(newPool, units * MEM_BUDDY_MIN_BLOCK, flags) != ALLOC_OK)
+    {
+        free(newPool->buddy);
+        free(newPool);
+        return NULL;
+    }
+
+    newPool->buddy->units = units;
+    newPool->buddy->max_order = max_order;
+    newPool->buddy->words = words;
+    for (k = 0, words = 0; k <= max_order; k++)
+    {
+        newPool->buddy->base[k] = words;
+        words += ((units >> k) + 63) / 64;
+    }
+
+    newPool->rover = newPool->pool.mem;
+    newPool->pool.policy = BUDDY;
+    newPool->pool.total_size = units * MEM_BUDDY_MIN_BLOCK;
+    newPool->cache_epoch = ++pool_cache_epoch;
+
+    // the free blocks' links are the first memory a lazy pool commits
+    if (_mem_buddy_reset(newPool) != ALLOC_OK)
+    {
+        _mem_unmap_pool(newPool);
+        free(newPool->buddy);
+        free(newPool);
+        return NULL;
+    }
+    _mem_pool_register(newPool);
+
+    return (pool_pt) newPool;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////////
 alloc_status mem_pool_close(pool_pt pool) {
+    // note: closing a pool other threads are still using is a caller bug,
+    // so only the store needs locking here
+    _mem_lock_store();
+    alloc_status status = _mem_pool_close(pool);
+    _mem_unlock_store();
+
+    return status;
+}
+
+// called with the store locked
+static alloc_status _mem_pool_close(pool_pt pool) {
     // get mgr from pool by casting the pointer to (pool_mgr_pt)
     pool_mgr_pt manager = ((pool_mgr_pt)pool);
 
@@ -343,16 +797,29 @@ alloc_status mem_pool_close(pool_pt pool) {
         return ALLOC_FAIL;
     }
 
-    // check if this pool only has one gap
-    if (manager->pool.num_gaps != 1)
+    // check if this pool only has one gap and zero allocations, before
+    // changing anything
+    alloc_status status = _mem_pool_closable(manager);
+    if (status != ALLOC_OK)
     {
-        return ALLOC_FAIL;
+        return status;
     }
-    if (manager->pool.num_allocs != 0)
+
+    // take back what the thread caches hold and drop the caches
+    if (manager->caches != NULL)
     {
-        return ALLOC_NOT_FREED;
+        _mem_lock_pool(manager);
+        while (manager->caches != NULL)
+        {
+            cache_pt cache = manager->caches;
+            _mem_cache_drain(manager, cache);
+            manager->caches = cache->next;
+            free(cache);
+        }
+        _mem_unlock_pool(manager);
+
+        manager->cache_epoch = ++pool_cache_epoch;
     }
-    // check if it has zero allocations
 
     // free memory pool
     // free node heap
@@ -363,10 +830,21 @@ alloc_status mem_pool_close(pool_pt pool) {
 
     // frees all of the attributes of the manager
     int i ;
-    free(manager->pool.mem);
+    _mem_unmap_pool(manager);
     manager->pool.mem = NULL;
     free(manager->node_heap);
     free(manager->gap_ix);
+    free(manager->tlsf);
+    free(manager->slab);
+    free(manager->buddy);
+    free(manager->alloc_ix);
+    free(manager->cache_class);
+    while (manager->retired_caches != NULL)
+    {
+        cache_pt cache = manager->retired_caches;
+        manager->retired_caches = cache->next;
+        free(cache);
+    }
     manager->node_heap =NULL;
     manager->gap_ix = NULL;
 
@@ -383,28 +861,104 @@ alloc_status mem_pool_close(pool_pt pool) {
         }
     }
 
+#ifdef MEM_POOL_THREAD_SAFE
+    pthread_mutex_destroy(&manager->lock);
+#endif
     free(manager);
     return ALLOC_OK;
 }
+
+// whether the pool can be closed: ALLOC_FAIL unless it is one gap and
+// ALLOC_NOT_FREED if it has allocations, not counting the segments that
+// only wait in thread caches
+// note: changes nothing, so a failed close leaves the pool as it was
+static alloc_status _mem_pool_closable(pool_mgr_pt manager) {
+    alloc_status status = ALLOC_OK;
+    unsigned cached = 0;
+
+    _mem_lock_pool(manager);
+
+    for (cache_pt cache = manager->caches; cache != NULL; cache = cache->next)
+    {
+        for (unsigned cls = 0; cls < MEM_CACHE_CLASSES; cls++)
+            cached += cache->count[cls];
+    }
+
+    // cached segments are gaps-to-be, so only an uncached pool must be one gap
+    if (cached == 0 && manager->pool.num_gaps != 1)
+        status = ALLOC_FAIL;
+    else if (manager->pool.num_allocs != cached)
+        status = ALLOC_NOT_FREED;
+
+    _mem_unlock_pool(manager);
+
+    return status;
+}
 /////////////////////////////////////////////////////////////////////////////////////////////////////
 // This function performs a single allocation of size in bytes from the given memory pool
 // Allocations from different memory pools are independent
 // Note: There is no mechanism for bounds-checking on the use of the allocations
 
 void * mem_new_alloc(pool_pt pool, size_t size) {
+    pool_mgr_pt managerPtr = ((pool_mgr_pt)pool);
+
+    if (managerPtr->cache_class != NULL && size <= pool->total_size) {
+        // cached pools only hand out whole granules, so that every segment
+        // starts on a granule and has a cache_class entry
+        size = (size + MEM_CACHE_GRANULE - 1) / MEM_CACHE_GRANULE * MEM_CACHE_GRANULE;
+
+        if (size != 0 && size <= MEM_CACHE_CLASSES * MEM_CACHE_GRANULE)
+            return _mem_cache_alloc(managerPtr, size);
+    }
+
+    _mem_lock_pool(managerPtr);
+    void *alloc = _mem_new_alloc(pool, size);
+    _mem_unlock_pool(managerPtr);
+
+    return alloc;
+}
+
+// called with the pool locked
+static void *_mem_new_alloc(pool_pt pool, size_t size) {
 
 
     // get mgr from pool by casting the pointer to (pool_mgr_pt)
     pool_mgr_pt managerPtr = ((pool_mgr_pt)pool);
 
+    // arenas, slabs and buddy pools don't use the node heap or the gap
+    // index at all
+    if (pool->policy == ARENA) {
+        return _mem_arena_alloc(managerPtr, size);
+    }
+    if (pool->policy == SLAB) {
+        return _mem_slab_alloc(managerPtr, size);
+    }
+    if (pool->policy == BUDDY) {
+        return _mem_buddy_alloc(managerPtr, size);
+    }
+
     // check if any gaps, return null if none
     if (pool->num_gaps == 0) {
         printf("No gaps available!\n");
         return NULL;
     }
 
+    // a zero-size allocation would share its address with the next segment
+    if (size == 0) {
+        return NULL;
+    }
+
     // resize node heap if too small
-    _mem_resize_node_heap(managerPtr);
+    if (_mem_resize_node_heap(managerPtr, 0) != ALLOC_OK) {
+        printf("No more nodes available!\n");
+        return NULL;
+    }
+
+    // resize the allocation index if too small
+    if (_mem_resize_alloc_ix(managerPtr, 1) != ALLOC_OK) {
+        printf("No room in allocation index!\n");
+        return NULL;
+    }
 
     // points to gap node where the new allocation will go
     node_pt nodeToReplace = NULL;
@@ -413,64 +967,98 @@ void * mem_new_alloc(pool_pt pool, size_t size) {
     size_t gapSize = 0;
 
     // if BEST_FIT:
-    // traverse through gap_ix array and look for first spot that the node
-    // will fit in
+    // descend the gap tree for the smallest gap the node will fit in
     if (pool->policy == BEST_FIT) {
 
-        // this checks the gap index for the first size
-        int i = 0;
+        unsigned i = _mem_find_gap_ix(managerPtr, size);
+
+        // if there is no gap big enough
+        if (i == MEM_GAP_IX_NIL) {
+            printf("No room for node!\n");
+            return NULL;
+        }
 
-        //while (managerPtr->gap_ix[i].size < size && i < pool->num_gaps) i++;
-        while (managerPtr->gap_ix[i].node->alloc_record.size < size && i < pool->num_gaps) i++;
+        else { // set the node found as the node to replace and remove from gap ix
+            nodeToReplace = &managerPtr->node_heap[managerPtr->gap_ix[i].node];
+            gapSize = managerPtr->gap_ix[i].size - size;
 
+            _mem_remove_from_gap_ix(managerPtr,
+                                    managerPtr->gap_ix[i].size,
+                                    nodeToReplace);
+        }
+    }
 
+    // if TLSF:
+    // take the head of the first non-empty size class that is sure to fit
+    else if (pool->policy == TLSF) {
 
+        unsigned i = _mem_tlsf_find(managerPtr, size);
 
-        // if the element we end on isn't big enough
-        if (managerPtr->gap_ix[i].size < size) {
+        if (i == MEM_GAP_IX_NIL) {
             printf("No room for node!\n");
             return NULL;
         }
 
-        else { // set the node found as the node to replace and remove from gap ix
-            nodeToReplace = managerPtr->gap_ix[i].node;
-            gapSize = managerPtr->gap_ix[i].node->alloc_record.size - size;
+        nodeToReplace = &managerPtr->node_heap[managerPtr->gap_ix[i].node];
+        gapSize = managerPtr->gap_ix[i].size - size;
 
-            _mem_remove_from_gap_ix(managerPtr,
-                                    managerPtr->gap_ix[i].node->alloc_record.size,
-                                    managerPtr->gap_ix[i].node);
-        }
+        _mem_remove_from_gap_ix(managerPtr, managerPtr->gap_ix[i].size, nodeToReplace);
     }
 
+    // if FIRST_FIT:
+    // descend the address-ordered gap tree for the lowest gap that fits,
+    // skipping the subtrees whose largest gap is too small
     else if (pool->policy == FIRST_FIT) {
 
-        nodeToReplace = managerPtr->node_heap; // set ptr to point at first element in node heap
-
-        // traverse until we find a node that isn't used and isn't too small
-        while (nodeToReplace->allocated == 1 || nodeToReplace->alloc_record.size < size)
-            nodeToReplace = nodeToReplace->next;
+        unsigned i = _mem_find_first_gap_ix(managerPtr, managerPtr->gap_ix_root, size);
 
-        if (nodeToReplace == NULL) {
+        if (i == MEM_GAP_IX_NIL) {
             printf("No room for node!\n");
             return NULL;
         }
 
-        // set new gapsize if there is one, nodeToReplace is already at the correct address
-        gapSize = nodeToReplace->alloc_record.size - size;
+        // set new gapsize if there is one
+        nodeToReplace = &managerPtr->node_heap[managerPtr->gap_ix[i].node];
+        gapSize = managerPtr->gap_ix[i].size - size;
+
+        // remove from the gap index
+        _mem_remove_from_gap_ix(managerPtr, managerPtr->gap_ix[i].size, nodeToReplace);
+    }
 
+    // if NEXT_FIT:
+    // same as FIRST_FIT, but starting from where the last search left off
+    // and wrapping around to the top of the pool
+    else if (pool->policy == NEXT_FIT) {
 
-        // after this line, k will be index of gap pointer to get rid of
-        int k = 0;
-        while (nodeToReplace != managerPtr->gap_ix[k].node && k < pool->num_gaps) k++;
+        unsigned i = _mem_find_next_gap_ix(managerPtr, size);
 
-        // see if where we stopped is correct
-        if (nodeToReplace != managerPtr->gap_ix[k].node) {
-            printf("Could not find node in gap index");
+        if (i == MEM_GAP_IX_NIL) {
+            printf("No room for node!\n");
             return NULL;
         }
 
-        // remove from the gap index
-        _mem_remove_from_gap_ix(managerPtr, nodeToReplace->alloc_record.size, managerPtr->gap_ix[k].node);
+        nodeToReplace = &managerPtr->node_heap[managerPtr->gap_ix[i].node];
+        gapSize = managerPtr->gap_ix[i].size - size;
+
+        _mem_remove_from_gap_ix(managerPtr, managerPtr->gap_ix[i].size, nodeToReplace);
+
+        // resume after this allocation next time
+        // note: an address rather than a node, so merges can't invalidate it
+        managerPtr->rover = _mem_node_mem(managerPtr, nodeToReplace) + size;
+    }
+
+    return _mem_alloc_from_gap(managerPtr, nodeToReplace, size, gapSize);
+}
+
+// turns the front of a gap node, already out of the gap index, into an
+// allocation of size bytes, leaving the other gapSize bytes as a gap
+static void *_mem_alloc_from_gap(pool_mgr_pt managerPtr, node_pt nodeToReplace, size_t size, size_t gapSize) {
+    pool_pt pool = &managerPtr->pool;
+
+    // make sure the memory can be used before anything changes
+    if (_mem_commit(managerPtr, _mem_node_mem(managerPtr, nodeToReplace), size) != ALLOC_OK) {
+        _mem_add_to_gap_ix(managerPtr, size + gapSize, nodeToReplace);
+        return NULL;
     }
 
     // now that we've found the node and gotten rid of it out of the gap_ix
@@ -479,44 +1067,47 @@ void * mem_new_alloc(pool_pt pool, size_t size) {
     // if gap size is bigger than zero, add a gap node
     if (gapSize > 0) {
 
-        // look for next available node to hold the gap
-        int j = 0;
-        while (managerPtr->node_heap[j].used == 1) j++;
+        // take the next available node to hold the gap
+        node_pt newGapPtr = _mem_get_node(managerPtr);
 
-        // if there's no more nodes available
-        if (managerPtr->node_heap[j].used == 1) {
+        // if there's no more nodes available, the gap goes back as it was
+        if (newGapPtr == NULL) {
+            _mem_add_to_gap_ix(managerPtr, size + gapSize, nodeToReplace);
             printf("No more nodes available!\n");
             return NULL;
         }
 
-        node_pt newGapPtr = &(managerPtr->node_heap[j]);
-
         // sets new gap's attributes
         newGapPtr->used = 1;
-        newGapPtr->alloc_record.size = gapSize;
+        newGapPtr->allocated = 0;
+        _mem_node_set_size(newGapPtr, gapSize);
+        _mem_node_set_mem(managerPtr, newGapPtr, _mem_node_mem(managerPtr, nodeToReplace) + size);
         newGapPtr->next = nodeToReplace->next;
+        if (newGapPtr->next != MEM_NODE_NIL)
+            managerPtr->node_heap[newGapPtr->next].prev = _mem_node_ix(managerPtr, newGapPtr);
 
         // set the gap to go after the allocated node
         // newnode prev should still be fine
 
-        nodeToReplace->next = newGapPtr;
+        nodeToReplace->next = _mem_node_ix(managerPtr, newGapPtr);
 
         // set gap node after new node
-        newGapPtr->prev = nodeToReplace;
+        newGapPtr->prev = _mem_node_ix(managerPtr, nodeToReplace);
 
         // add the new (smaller) gap to the gap index
         _mem_add_to_gap_ix(managerPtr, gapSize, newGapPtr);
-
-        managerPtr->used_nodes++;
     }
 
     // do not need to reset newNode pointers if it takes up the entire allocation
 
     // set newNode attributes:
-    nodeToReplace->alloc_record.size = size;
+    _mem_node_set_size(nodeToReplace, size);
     nodeToReplace->used = 1;
     nodeToReplace->allocated = 1;
 
+    // file the allocation under its address
+    _mem_add_to_alloc_ix(managerPtr, nodeToReplace);
+
     // set pool attributes
     pool->num_allocs++;
     pool->alloc_size = pool->alloc_size + size;
@@ -529,16 +1120,143 @@ void * mem_new_alloc(pool_pt pool, size_t size) {
     printf("Is allocated: ");
     printf("%u\n", nodeToReplace->allocated);
     printf("Space allocated: ");
-    printf("%d\n", (int)nodeToReplace->alloc_record.size);
+    printf("%d\n", (int)_mem_node_size(nodeToReplace));
     printf("Prev node: ");
-    printf("%p\n", nodeToReplace->prev);
+    printf("%u\n", nodeToReplace->prev);
     printf("Next node: ");
-    printf("%p\n", nodeToReplace->next);
+    printf("%u\n", nodeToReplace->next);
     printf("---------------------------\n");
      */
 
     // return the user-requested memory
-    return ((alloc_pt)nodeToReplace);
+    // note: this is the allocation's address in the pool, not the node,
+    // which moves whenever the node heap is expanded
+    return _mem_node_mem(managerPtr, nodeToReplace);
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+// Allocates size bytes at an address that is a multiple of alignment (a
+// power of two)
+// The allocation goes in the first gap (FIRST_FIT and NEXT_FIT) or the
+// smallest gap (BEST_FIT) that still fits it after rounding the gap's
+// start up to alignment, and the bytes skipped are left as a gap before
+// it. TLSF takes a gap that fits size + alignment - 1. Free it with
+// mem_del_alloc() as usual.
+void *mem_new_alloc_aligned(pool_pt pool, size_t size, size_t alignment) {
+    pool_mgr_pt managerPtr = ((pool_mgr_pt)pool);
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || size > pool->total_size) {
+        return NULL;
+    }
+
+    // bypass the thread cache, but keep to whole granules
+    if (managerPtr->cache_class != NULL) {
+        size = (size + MEM_CACHE_GRANULE - 1) / MEM_CACHE_GRANULE * MEM_CACHE_GRANULE;
+        if (alignment < MEM_CACHE_GRANULE)
+            alignment = MEM_CACHE_GRANULE;
+    }
+
+    _mem_lock_pool(managerPtr);
+    void *alloc = _mem_new_alloc_aligned(managerPtr, size, alignment);
+    _mem_unlock_pool(managerPtr);
+
+    return alloc;
+}
+
+// called with the pool locked
+static void *_mem_new_alloc_aligned(pool_mgr_pt pool_mgr, size_t size, size_t alignment) {
+    pool_pt pool = &pool_mgr->pool;
+    char *alloc;
+
+    if (size == 0 || size > pool->total_size) {
+        return NULL;
+    }
+
+    // an arena counts the pad as part of the allocation
+    if (pool->policy == ARENA) {
+        size_t pad = _mem_align_pad(pool_mgr->rover, alignment);
+
+        alloc = _mem_arena_alloc(pool_mgr, pad + size);
+        return (alloc == NULL) ? NULL : alloc + pad;
+    }
+
+    // slab objects and buddy blocks are where they are: a buddy block is
+    // aligned to its size from the start of the pool, and a slab object
+    // to its stride
+    if (pool->policy == SLAB || pool->policy == BUDDY) {
+        alloc = (pool->policy == SLAB) ? _mem_slab_alloc(pool_mgr, size)
+                                       : _mem_buddy_alloc(pool_mgr, (size < alignment) ? alignment : size);
+        if (alloc != NULL && _mem_align_pad(alloc, alignment) != 0) {
+            _mem_del_alloc(pool, alloc);
+            alloc = NULL;
+        }
+        return alloc;
+    }
+
+    if (pool->num_gaps == 0) {
+        return NULL;
+    }
+
+    // the pad and the tail may each take a node
+    if (_mem_resize_node_heap(pool_mgr, 1) != ALLOC_OK) {
+        printf("No more nodes available!\n");
+        return NULL;
+    }
+    if (_mem_resize_alloc_ix(pool_mgr, 1) != ALLOC_OK) {
+        printf("No room in allocation index!\n");
+        return NULL;
+    }
+
+    unsigned i;
+    if (pool->policy == TLSF)
+        i = (alignment - 1 > pool->total_size - size) ? MEM_GAP_IX_NIL
+                                                      : _mem_tlsf_find(pool_mgr, size + alignment - 1);
+    else
+        i = _mem_find_aligned_gap_ix(pool_mgr, pool_mgr->gap_ix_root, size, alignment);
+
+    if (i == MEM_GAP_IX_NIL) {
+        printf("No room for node!\n");
+        return NULL;
+    }
+
+    node_pt node = &pool_mgr->node_heap[pool_mgr->gap_ix[i].node];
+    size_t gapSize = _mem_node_size(node);
+    size_t pad = _mem_align_pad(_mem_node_mem(pool_mgr, node), alignment);
+
+    if (_mem_commit(pool_mgr, _mem_node_mem(pool_mgr, node) + pad, size) != ALLOC_OK) {
+        return NULL;
+    }
+
+    _mem_remove_from_gap_ix(pool_mgr, gapSize, node);
+
+    // the pad stays a gap, and the rest of the gap gets a node of its own
+    if (pad > 0) {
+        node_pt rest = _mem_get_node(pool_mgr);
+        if (rest == NULL) {
+            _mem_add_to_gap_ix(pool_mgr, gapSize, node);
+            printf("No more nodes available!\n");
+            return NULL;
+        }
+
+        rest->allocated = 0;
+        _mem_node_set_mem(pool_mgr, rest, _mem_node_mem(pool_mgr, node) + pad);
+        _mem_node_set_size(rest, gapSize - pad);
+        rest->next = node->next;
+        rest->prev = _mem_node_ix(pool_mgr, node);
+        if (rest->next != MEM_NODE_NIL)
+            pool_mgr->node_heap[rest->next].prev = _mem_node_ix(pool_mgr, rest);
+        node->next = _mem_node_ix(pool_mgr, rest);
+
+        _mem_node_set_size(node, pad);
+        _mem_add_to_gap_ix(pool_mgr, pad, node);
+
+        node = rest;
+        gapSize -= pad;
+    }
+
+    if (pool->policy == NEXT_FIT)
+        pool_mgr->rover = _mem_node_mem(pool_mgr, node) + size;
+
+    return _mem_alloc_from_gap(pool_mgr, node, size, gapSize - size);
 }
 
 
@@ -561,172 +1279,281 @@ void * mem_new_alloc(pool_pt pool, size_t size) {
 //   update linked list (new node right after the node for allocation)
 //   add to gap index
 //   check if successful
-// return allocation record by casting the node to (alloc_pt)
+// file the node in the allocation index
+// return the allocation's memory (alloc_record.mem)
 
 
 // This function deallocates the given allocation from the given memory pool
 alloc_status mem_del_alloc(pool_pt pool, void * alloc) {
+    pool_mgr_pt managerPtr = ((pool_mgr_pt)pool);
+
+    if (managerPtr->cache_class != NULL) {
+        alloc_status status = _mem_cache_free(managerPtr, alloc);
+        if (status == ALLOC_OK)
+            return ALLOC_OK;
+        if (status == ALLOC_CALLED_AGAIN) {
+            printf("Allocation freed twice\n");
+            return ALLOC_FAIL;
+        }
+    }
+
+    _mem_lock_pool(managerPtr);
+    alloc_status status = _mem_del_alloc(pool, alloc);
+    _mem_unlock_pool(managerPtr);
+
+    return status;
+}
+
+// called with the pool locked
+static alloc_status _mem_del_alloc(pool_pt pool, void * alloc) {
 
     // get mgr from pool by casting the pointer to (pool_mgr_pt)
     pool_mgr_pt managerPtr = ((pool_mgr_pt)pool);
 
-    // get node from alloc by casting the pointer to (node_pt)
-    node_pt deletePtr = ((node_pt)alloc);
+    if (pool->policy == ARENA) {
+        return _mem_arena_free(managerPtr, alloc);
+    }
+    if (pool->policy == SLAB) {
+        return _mem_slab_free(managerPtr, alloc);
+    }
+    if (pool->policy == BUDDY) {
+        // merging with the buddy replaces the neighbour merges below
+        return _mem_buddy_free(managerPtr, alloc);
+    }
 
-    // find the node in the node heap
+    // look the allocation up by its address
     // this is node-to-delete
-    node_pt nodePtr = managerPtr->node_heap; // point at head of linked list
+    node_pt nodePtr = NULL;
 
-    while (nodePtr && nodePtr != deletePtr) nodePtr = nodePtr->next;
-    // traverse to find node
-    // if we've gone to the end of the list and not found it
-    if (nodePtr == NULL) {
+    if ((char *) alloc >= pool->mem && (char *) alloc < pool->mem + pool->total_size)
+        nodePtr = _mem_find_alloc_ix(managerPtr, alloc);
+
+    // if it's not an allocation from this pool
+    if (nodePtr == NULL || nodePtr->used == 0 || nodePtr->allocated == 0) {
         printf("Node to delete not found in memory pool\n");
         return ALLOC_FAIL;
     }
 
     // convert to gap node
+    _mem_remove_from_alloc_ix(managerPtr, nodePtr);
     nodePtr->allocated = 0;
-    nodePtr->alloc_record.mem = NULL;
-
-    // do this later:
-    // add gap to gap index
-    _mem_add_to_gap_ix(managerPtr, nodePtr->alloc_record.size, nodePtr);
 
     // update metadata (num_allocs, alloc_size)
     pool->num_allocs--;
-    pool->alloc_size = pool->alloc_size - nodePtr->alloc_record.size;
+    pool->alloc_size = pool->alloc_size - _mem_node_size(nodePtr);
 
-    // if previous node is a gap and current node is not the head
-    // then just move the pointer up one node
-    // then next block will take over with merging
-    if (nodePtr->prev != NULL && nodePtr->prev->allocated == 0) {
+    // if the previous node is also a gap, merge node-to-delete into it
+    // the gap index is keyed on size, so the previous gap has to come out
+    // of the index before its size changes
+    node_pt prevGap = _mem_node(managerPtr, nodePtr->prev);
+    if (prevGap != NULL && prevGap->allocated == 0) {
 
-        nodePtr = nodePtr->prev;
-
-        // this is set for below when we check for success
-        deletePtr = nodePtr;
-    }
+        //   remove the previous node from gap index
+        if (_mem_remove_from_gap_ix(managerPtr, _mem_node_size(prevGap), prevGap) != ALLOC_OK) {
+            printf("Error: node not deleted from gap index");
+            return ALLOC_FAIL; // ideally this should never happen
+        }
 
-    // if the next node in the list is also a gap, merge into node-to-delete
-    if (nodePtr->next != NULL && nodePtr->next->allocated == 0) {
+        //   add the size of node-to-delete to the previous
+        _mem_node_set_size(prevGap, _mem_node_size(prevGap) + _mem_node_size(nodePtr));
 
-        node_pt extraGap = nodePtr->next;
+        // connects the previous gap to the node after node-to-delete
+        prevGap->next = nodePtr->next;
+        if (prevGap->next != MEM_NODE_NIL)
+            managerPtr->node_heap[prevGap->next].prev = nodePtr->prev;
 
-        //   add the size to the node-to-delete
-        nodePtr->alloc_record.size =
-                nodePtr->alloc_record.size + extraGap->alloc_record.size;
+        //   update node-to-delete as unused
+        _mem_put_node(managerPtr, nodePtr);
 
+        // the previous gap is now the node to add to the gap index
+        nodePtr = prevGap;
+    }
 
+    // if the next node in the list is also a gap, merge into node-to-delete
+    node_pt extraGap = _mem_node(managerPtr, nodePtr->next);
+    if (extraGap != NULL && extraGap->allocated == 0) {
 
         //   remove the next node from gap index
-        _mem_remove_from_gap_ix(managerPtr, extraGap->alloc_record.size, extraGap);
-
-        //   check success
-        // traverse the array to see if we can find the node or reach the end of the array
-        int i = 0;
-        while (managerPtr->gap_ix[i].node != extraGap && i < managerPtr->gap_ix_capacity) i++;
-        if (managerPtr->gap_ix[i].node == extraGap) {
+        if (_mem_remove_from_gap_ix(managerPtr, _mem_node_size(extraGap), extraGap) != ALLOC_OK) {
             printf("Error: node not deleted from gap index");
             return ALLOC_FAIL; // ideally this should never happen
         }
 
-        // update old gapnode as unused
-        extraGap->alloc_record.size = 0;
-        extraGap->alloc_record.mem = NULL; // should already be null but eh
-        extraGap->allocated = 0;
-        extraGap->used = 0;
-        extraGap->prev = NULL;
+        //   add the size to the node-to-delete
+        _mem_node_set_size(nodePtr, _mem_node_size(nodePtr) + _mem_node_size(extraGap));
 
         // connects the new gap to the node after the merged gap
         nodePtr->next = extraGap->next;
 
-        // now extraGap node points to nothing
-        extraGap->next = NULL;
-
         // set next node to point at correct thing
-        if (nodePtr->next != NULL)
-            nodePtr->next->prev = nodePtr;
+        if (nodePtr->next != MEM_NODE_NIL)
+            managerPtr->node_heap[nodePtr->next].prev = _mem_node_ix(managerPtr, nodePtr);
 
+        // update old gapnode as unused
+        _mem_put_node(managerPtr, extraGap);
     }
 
-    // this block is required for if there is a gap at the beginning as well as the end
-    // literally just a copy of the block above
-    // an ugly way to do it
-    // but it saves me writing different code for a post-node deletion
-    if (nodePtr->next != NULL && nodePtr->next->allocated == 0) {
+    // add the resulting node to the gap index
+    if (_mem_add_to_gap_ix(managerPtr, _mem_node_size(nodePtr), nodePtr) != ALLOC_OK) {
+        printf("Cannot add gap node after deallocation");
+        return ALLOC_FAIL;
+    }
 
-        node_pt extraGap = nodePtr->next;
+    return ALLOC_OK;
 
-        //   add the size to the node-to-delete
-        nodePtr->alloc_record.size =
-                nodePtr->alloc_record.size + extraGap->alloc_record.size;
-        //node
-        //   remove the next node from gap index
-        _mem_remove_from_gap_ix(managerPtr, extraGap->alloc_record.size, extraGap);
 
-        //   check success
-        // traverse the array to see if we can find the node or reach the end of the array
-        int i = 0;
-        while (managerPtr->gap_ix[i].node != extraGap && i < managerPtr->gap_ix_capacity) i++;
-        if (managerPtr->gap_ix[i].node == extraGap) {
-            printf("Error: node not deleted from gap index");
-            return ALLOC_FAIL; // ideally this should never happen
-        }
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+// Resizes an allocation, keeping its contents up to the smaller size
+// Grows into the gap right after the allocation if that is big enough,
+// and shrinks by giving the tail back as a gap; only when neither works
+// is the allocation moved (allocate, copy, free). Like realloc(), a NULL
+// alloc allocates, a new_size of 0 frees, and on failure NULL is
+// returned with alloc left as it was.
+void *mem_realloc(pool_pt pool, void *alloc, size_t new_size) {
+    pool_mgr_pt managerPtr = ((pool_mgr_pt)pool);
+    size_t oldSize = 0;
 
-        // update old gapnode as unused
-        extraGap->alloc_record.size = 0;
-        extraGap->alloc_record.mem = NULL; // should already be null but eh
-        extraGap->allocated = 0;
-        extraGap->used = 0;
-        extraGap->prev = NULL;
+    if (alloc == NULL) {
+        return mem_new_alloc(pool, new_size);
+    }
+    if (new_size == 0) {
+        mem_del_alloc(pool, alloc);
+        return NULL;
+    }
 
-        // connects the new gap to the node after the merged gap
-        nodePtr->next = extraGap->next;
+    _mem_lock_pool(managerPtr);
+    void *resized = _mem_realloc_in_place(managerPtr, alloc, new_size, &oldSize);
+    _mem_unlock_pool(managerPtr);
 
-        // now extraGap node points to nothing
-        extraGap->next = NULL;
+    // not an allocation of the pool, or resized in place
+    if (oldSize == 0 || resized != NULL) {
+        return resized;
+    }
 
-        // set next node to point at correct thing
-        if (nodePtr->next != NULL)
-            nodePtr->next->prev = nodePtr;
+    void *moved = mem_new_alloc(pool, new_size);
+    if (moved == NULL) {
+        return NULL;
+    }
+
+    memcpy(moved, alloc, (oldSize < new_size) ? oldSize : new_size);
+    mem_del_alloc(pool, alloc);
+
+    return moved;
+}
+
+// called with the pool locked
+// returns alloc if it could be resized where it is, else NULL, with
+// *old_size set to how many bytes of alloc a move should copy (0 if
+// alloc isn't an allocation of the pool)
+static void *_mem_realloc_in_place(pool_mgr_pt pool_mgr, void *alloc, size_t size, size_t *old_size) {
+    pool_pt pool = &pool_mgr->pool;
+    char *mem = alloc;
 
+    *old_size = 0;
+
+    if (pool->policy == BUDDY) {
+        return _mem_buddy_resize(pool_mgr, alloc, size, old_size);
     }
 
+    // an arena only knows where its top is, so copy up to there
+    if (pool->policy == ARENA) {
+        if (mem >= pool->mem && mem < pool_mgr->rover && pool->num_allocs > 0)
+            *old_size = (size_t) (pool_mgr->rover - mem);
+        return NULL;
+    }
 
-    // this merged node-to-delete might need to be added to the gap index
-    // but one more thing to check...
-    // if the previous node in the list is also a gap, merge into previous!
-    //   remove the previous node from gap index
-    //   check success
-    //   add the size of node-to-delete to the previous
-    //   update node-to-delete as unused
-    //   update metadata (used_nodes)
-    //   change the node to add to the previous node!
-    // add the resulting node to the gap index
+    // a slab object has room for object_size bytes, and nowhere to grow
+    if (pool->policy == SLAB) {
+        slab_pt slab = pool_mgr->slab;
 
-    // organize gap index
-    _mem_sort_gap_ix(managerPtr);
+        if (mem >= pool->mem && mem < pool->mem + pool->total_size
+            && (size_t) (mem - pool->mem) % slab->stride == 0
+            && _mem_slab_bit(slab, (long) ((size_t) (mem - pool->mem) / slab->stride))) {
+            *old_size = slab->object_size;
+            if (size <= slab->object_size)
+                return alloc;
+        }
+        return NULL;
+    }
 
-    // check success
-    nodePtr = managerPtr->node_heap; // point nodePtr back at the head
+    // a shrink may take a node for the tail gap; get the heap big enough
+    // first, since growing it moves the nodes
+    // note: if it can't grow, a shrink keeps the whole segment (see below)
+    (void) _mem_resize_node_heap(pool_mgr, 0);
 
-    // look for the new gapnode in the linked list
-    while (nodePtr != deletePtr && nodePtr != NULL) nodePtr = nodePtr->next;
-    if (nodePtr == NULL) {
-        printf("Cannot find gap node after deallocation");
-        return ALLOC_FAIL;
+    node_pt node = NULL;
+    if (mem >= pool->mem && mem < pool->mem + pool->total_size)
+        node = _mem_find_alloc_ix(pool_mgr, mem);
+    if (node == NULL || node->used == 0 || node->allocated == 0) {
+        printf("Node to resize not found in memory pool\n");
+        return NULL;
+    }
+
+    *old_size = _mem_node_size(node);
+
+    // cached pools keep every segment to whole granules, so just move
+    if (pool_mgr->cache_class != NULL) {
+        return NULL;
     }
 
+    node_pt next = _mem_node(pool_mgr, node->next);
+
+    if (size < *old_size) {
+        size_t tail = *old_size - size;
+
+        // the tail joins the gap after the allocation, or becomes one
+        if (next != NULL && next->allocated == 0) {
+            _mem_remove_from_gap_ix(pool_mgr, _mem_node_size(next), next);
+            _mem_node_set_mem(pool_mgr, next, mem + size);
+            _mem_node_set_size(next, _mem_node_size(next) + tail);
+            _mem_add_to_gap_ix(pool_mgr, _mem_node_size(next), next);
+        } else {
+            node_pt gap = _mem_get_node(pool_mgr);
+            if (gap == NULL) {
+                // keep the whole segment rather than fail the shrink
+                return alloc;
+            }
 
-    // _mem_remove_from_gap_ix() already increments the number of gaps
-    //if ( managerPtr->pool.num_gaps == 0)//managerPtr->pool.alloc_size == 0 &&
-    //managerPtr->pool.num_gaps++;
+            gap->allocated = 0;
+            _mem_node_set_mem(pool_mgr, gap, mem + size);
+            _mem_node_set_size(gap, tail);
+            gap->next = node->next;
+            gap->prev = _mem_node_ix(pool_mgr, node);
+            if (gap->next != MEM_NODE_NIL)
+                pool_mgr->node_heap[gap->next].prev = _mem_node_ix(pool_mgr, gap);
+            node->next = _mem_node_ix(pool_mgr, gap);
+            _mem_add_to_gap_ix(pool_mgr, tail, gap);
+        }
 
+        _mem_node_set_size(node, size);
+        pool->alloc_size -= tail;
+    } else if (size > *old_size) {
+        size_t grow = size - *old_size;
 
-    return ALLOC_OK;
+        if (next == NULL || next->allocated == 1 || _mem_node_size(next) < grow
+            || _mem_commit(pool_mgr, mem + *old_size, grow) != ALLOC_OK) {
+            return NULL;
+        }
 
+        // take the front of the next gap, or all of it
+        _mem_remove_from_gap_ix(pool_mgr, _mem_node_size(next), next);
+        if (_mem_node_size(next) == grow) {
+            node->next = next->next;
+            if (next->next != MEM_NODE_NIL)
+                pool_mgr->node_heap[next->next].prev = _mem_node_ix(pool_mgr, node);
+            _mem_put_node(pool_mgr, next);
+        } else {
+            _mem_node_set_mem(pool_mgr, next, mem + size);
+            _mem_node_set_size(next, _mem_node_size(next) - grow);
+            _mem_add_to_gap_ix(pool_mgr, _mem_node_size(next), next);
+        }
+
+        _mem_node_set_size(node, size);
+        pool->alloc_size += grow;
+    }
 
+    return alloc;
 }
 
 
@@ -743,19 +1570,91 @@ alloc_status mem_del_alloc(pool_pt pool, void * alloc) {
         // allocate the segments array with size == used_nodes
 
         //segments = malloc(sizeof(pool_segment_pt));
+        _mem_lock_pool(manager);
+
+        // an arena is everything below the top, allocated, and the rest
+        if (pool->policy == ARENA) {
+            size_t used = (size_t) (manager->rover - pool->mem);
+
+            *segments = malloc(2 * sizeof(pool_segment_t));
+            assert(*segments != NULL);
+            *num_segments = 0;
+            if (used > 0) {
+                (*segments)[*num_segments].size = used;
+                (*segments)[(*num_segments)++].allocated = 1;
+            }
+            if (used < pool->total_size) {
+                (*segments)[*num_segments].size = pool->total_size - used;
+                (*segments)[(*num_segments)++].allocated = 0;
+            }
+
+            _mem_unlock_pool(manager);
+            return;
+        }
+
+        // a slab is runs of allocated and free objects
+        if (pool->policy == SLAB) {
+            slab_pt slab = manager->slab;
+
+            *segments = malloc((pool->num_allocs + pool->num_gaps) * sizeof(pool_segment_t));
+            assert(*segments != NULL);
+            *num_segments = 0;
+            for (long o = 0; o < (long) slab->count; o++) {
+                int allocated = _mem_slab_bit(slab, o);
+                if (o == 0 || allocated != _mem_slab_bit(slab, o - 1)) {
+                    (*segments)[*num_segments].size = 0;
+                    (*segments)[(*num_segments)++].allocated = allocated;
+                }
+                (*segments)[*num_segments - 1].size += slab->stride;
+            }
+
+            _mem_unlock_pool(manager);
+            return;
+        }
+
+        // a buddy pool is its allocated blocks, with runs of free blocks
+        // shown as one gap
+        if (pool->policy == BUDDY) {
+            buddy_pt buddy = manager->buddy;
+            int allocated, prev = 1;
+
+            *segments = malloc((pool->num_allocs + pool->num_gaps) * sizeof(pool_segment_t));
+            assert(*segments != NULL);
+            *num_segments = 0;
+            for (size_t u = 0; u < buddy->units; ) {
+                unsigned order = _mem_buddy_order(buddy, u, &allocated);
+                if (allocated || prev) {
+                    (*segments)[*num_segments].size = 0;
+                    (*segments)[(*num_segments)++].allocated = allocated;
+                }
+                (*segments)[*num_segments - 1].size += MEM_BUDDY_MIN_BLOCK << order;
+                prev = allocated;
+                u += (size_t) 1 << order;
+            }
+
+            _mem_unlock_pool(manager);
+            return;
+        }
+
         *segments = malloc(manager->used_nodes* sizeof(pool_segment_t));
         assert(segments != NULL);
 
         // check successful
         // loop through the node heap and the segments array
 
-        for (i = 0; i <manager->used_nodes; i++){
+        // note: the nodes are packed in the heap in no particular order,
+        // so follow the linked list to get them in pool order
+        node_pt nodePtr = manager->node_heap;
+        for (i = 0; i <manager->used_nodes && nodePtr != NULL; i++){
             //(*segments)[i] = malloc(sizeof(pool_segment_t));
-            (*segments)[i].size = manager->node_heap[i].alloc_record.size;
-            (*segments)[i].allocated = manager->node_heap[i].allocated;
+            (*segments)[i].size = _mem_node_size(nodePtr);
+            (*segments)[i].allocated = nodePtr->allocated;
+            nodePtr = _mem_node(manager, nodePtr->next);
         }
 
         *num_segments = manager->used_nodes;
+
+        _mem_unlock_pool(manager);
         //    for each node, write the size and allocated in the segment
         // "return" the values:
         /*
@@ -766,272 +1665,2232 @@ alloc_status mem_del_alloc(pool_pt pool, void * alloc) {
 
 
 
-/***********************************/
-/*                                 */
-/* Definitions of static functions */
-/*                                 */
-/***********************************/
-static alloc_status _mem_resize_pool_store() {
-    // check if necessary
-    /*
-                if (((float) pool_store_size / pool_store_capacity)
-                    > MEM_POOL_STORE_FILL_FACTOR) {...}
-     */
-    // don't forget to update capacity variables
-
-
-    if (((float) pool_store_size / pool_store_capacity) > MEM_POOL_STORE_FILL_FACTOR) {
-
-        pool_mgr_pt * temp = realloc(pool_store, pool_store_capacity * MEM_POOL_STORE_EXPAND_FACTOR
-                                                 * sizeof(pool_mgr_pt));
+size_t mem_inspect_metadata(pool_pt pool) {
+    pool_mgr_pt manager = (pool_mgr_pt) pool;
+    size_t bytes = sizeof(pool_mgr_t);
 
-        if (!temp)
-        {
-            return ALLOC_FAIL;
-        }
+    _mem_lock_pool(manager);
 
-        else
-        {
-            pool_store = temp;
-        }
-        pool_store_capacity = MEM_POOL_STORE_EXPAND_FACTOR * MEM_POOL_STORE_INIT_CAPACITY;
+    // bookkeeping the pool owns, not counting the pool memory itself
+    bytes += manager->total_nodes * sizeof(node_t);
+    bytes += manager->gap_ix_capacity * sizeof(gap_t);
+    bytes += manager->alloc_ix_capacity * sizeof(unsigned);
+    if (manager->tlsf != NULL)
+        bytes += sizeof(tlsf_t);
+    if (manager->slab != NULL)
+        bytes += sizeof(slab_t) + (manager->slab->count + 63) / 64 * sizeof(uint64_t);
+    if (manager->buddy != NULL)
+        bytes += sizeof(buddy_t) + 2 * manager->buddy->words * sizeof(uint64_t);
+    if (manager->trimmed != NULL)
+        bytes += (manager->mapped_size / manager->page_size + 63) / 64 * sizeof(uint64_t);
+    if (manager->reserved != NULL)
+        bytes += (manager->mapped_size / manager->page_size + 63) / 64 * sizeof(uint64_t);
 
-        return ALLOC_OK;
-    }
-    else
-    {
-        return ALLOC_FAIL;
-    }
+    _mem_unlock_pool(manager);
 
+    return bytes;
 }
 
 
-static alloc_status _mem_resize_node_heap(pool_mgr_pt pool_mgr) {
-
-    int i;
-
-    int item[pool_mgr->gap_ix_capacity];
-
 
-//        map one array to the other via indexes indicating the pointers
-    node_pt it;
-    int j;
-    for (i = 0; i < pool_mgr->gap_ix_capacity; i++) {
-        item[i] =2147483647;
-        it = pool_mgr->gap_ix[i].node;
-        if (it == &pool_mgr->node_heap[i])
-        {
-            item[i] = i;
-        }
+// Turns on per-thread caching for the pool, which must be empty
+// Sizes are rounded up to whole granules from then on. Segments freed
+// into a thread's cache still count as allocations in the pool until
+// they are flushed, so threads should call mem_pool_cache_flush() before
+// they exit. The cache_* counters in pool_t are brought up to date
+// whenever a cache refills or flushes.
+alloc_status mem_pool_cache_enable(pool_pt pool) {
+    pool_mgr_pt manager = (pool_mgr_pt) pool;
+    alloc_status status = ALLOC_OK;
+
+    _mem_lock_pool(manager);
+
+    if (manager->cache_class != NULL) {
+        status = ALLOC_CALLED_AGAIN;
+    } else if (pool->policy == ARENA || pool->policy == SLAB) {
+        // arena and slab allocations are already as cheap as a cache hit
+        status = ALLOC_FAIL;
+    } else if (pool->policy == BUDDY) {
+        // buddy blocks are powers of two, not whole granules
+        status = ALLOC_FAIL;
+    } else if (pool->num_allocs != 0) {
+        // existing segments need not start on a granule
+        status = ALLOC_NOT_FREED;
+    } else {
+        manager->cache_class = calloc(pool->total_size / MEM_CACHE_GRANULE + 1, 1);
+        if (manager->cache_class == NULL)
+            status = ALLOC_FAIL;
     }
 
-    if (((float) pool_mgr->used_nodes/ pool_mgr->total_nodes)
-        > MEM_NODE_HEAP_FILL_FACTOR){
+    _mem_unlock_pool(manager);
 
-        int gapIndexTemp[pool_mgr->total_nodes];
+    return status;
+}
 
+// Returns the top of an ARENA pool, to release back to later
+pool_mark_t mem_pool_mark(pool_pt pool) {
+    pool_mgr_pt manager = (pool_mgr_pt) pool;
+    pool_mark_t mark;
 
-        node_pt temp = realloc(pool_mgr->node_heap, pool_mgr->total_nodes * MEM_NODE_HEAP_EXPAND_FACTOR
-                                                    * sizeof(node_t));
+    _mem_lock_pool(manager);
+    mark.offset = (size_t) (manager->rover - pool->mem);
+    mark.num_allocs = pool->num_allocs;
+    _mem_unlock_pool(manager);
 
-        if (!temp)
-        {
-            return ALLOC_FAIL;
-        }
+    return mark;
+}
 
-        pool_mgr->node_heap = temp;
+// Frees everything allocated in an ARENA pool since the mark was taken
+// Marks nest like a stack: releasing to a mark also drops every later one.
+alloc_status mem_pool_release_to_mark(pool_pt pool, pool_mark_t mark) {
+    pool_mgr_pt manager = (pool_mgr_pt) pool;
+    alloc_status status = ALLOC_OK;
+
+    _mem_lock_pool(manager);
+
+    if (pool->policy != ARENA) {
+        status = ALLOC_FAIL;
+    } else if (pool->mem + mark.offset > manager->rover || mark.num_allocs > pool->num_allocs) {
+        // already released past this mark
+        status = ALLOC_FAIL;
+    } else {
+        _mem_arena_set_top(manager, pool->mem + mark.offset, mark.num_allocs);
+    }
 
-        //remap the memory from the array
-        for (i = 0; i < pool_mgr->gap_ix_capacity; i++) {
-            if (item[i] != 2147483647)
-            {
-                //item[i] = j;
-                pool_mgr->gap_ix[i].node = &pool_mgr->node_heap[i];
-            }
-        }
+    _mem_unlock_pool(manager);
 
+    return status;
+}
 
-        for (i = pool_mgr->total_nodes; i < pool_mgr->total_nodes* MEM_NODE_HEAP_EXPAND_FACTOR; i++)
-        {
-            pool_mgr->node_heap[i].next = NULL;
-            pool_mgr->node_heap[i].prev = NULL;
-            pool_mgr->node_heap[i].allocated = 0;
-            pool_mgr->node_heap[i].used = 0;
-            pool_mgr->node_heap[i].alloc_record.size = 0;
-            pool_mgr->node_heap[i].alloc_record.mem = NULL;
-        }
-        pool_mgr->total_nodes = pool_mgr->total_nodes * MEM_NODE_HEAP_EXPAND_FACTOR;
+// Frees every allocation of the pool at once, leaving one gap the size
+// of the pool
+// The node heap and the indexes keep their capacity. Nodes and gap
+// slots are set up lazily, so this doesn't touch them. This takes no
+// time per allocation, but it isn't constant: it clears the allocation
+// index over its capacity and, for a cached pool, the size class table
+// over the whole pool (a byte per 16).
+alloc_status mem_pool_reset(pool_pt pool) {
+    pool_mgr_pt manager = (pool_mgr_pt) pool;
+    unsigned long epoch;
+
+    if (pool->mem == NULL)
+    {
+        return ALLOC_FAIL;
+    }
 
+    // the epoch counter is shared by all pools; take it before the pool
+    // lock, in the order mem_pool_close() takes the two locks
+    _mem_lock_store();
+    epoch = ++pool_cache_epoch;
+    _mem_unlock_store();
 
+    _mem_lock_pool(manager);
 
+    // cached segments refer to allocations that are gone
+    if (manager->caches != NULL)
+    {
+        // other threads use their caches without the lock, so rather than
+        // empty them, retire them whole: the new epoch makes every thread
+        // start a fresh cache
+        cache_pt last = manager->caches;
+        while (last->next != NULL)
+            last = last->next;
+        last->next = manager->retired_caches;
+        manager->retired_caches = manager->caches;
+        manager->caches = NULL;
+        manager->cache_epoch = epoch;
+    }
+    if (manager->cache_class != NULL)
+    {
+        memset(manager->cache_class, 0, pool->total_size / MEM_CACHE_GRANULE + 1);
+    }
 
+    if (pool->policy == SLAB)
+    {
+        _mem_slab_reset(manager);
+        _mem_unlock_pool(manager);
         return ALLOC_OK;
     }
-    else {
-        return ALLOC_FAIL;
+    if (pool->policy == BUDDY)
+    {
+        alloc_status status = _mem_buddy_reset(manager);
+        _mem_unlock_pool(manager);
+        return status;
     }
-}
-
-static alloc_status _mem_resize_gap_ix(pool_mgr_pt pool_mgr) {
 
+    // forget every node and gap slot handed out so far
+    manager->used_nodes = 0;
+    manager->free_nodes = MEM_NODE_NIL;
+    manager->fresh_nodes = 0;
+    manager->gap_ix_root = MEM_GAP_IX_NIL;
+    manager->gap_ix_free = MEM_GAP_IX_NIL;
+    manager->gap_ix_fresh = 0;
+    memset(manager->alloc_ix, 0xff, manager->alloc_ix_capacity * sizeof(unsigned));
+    if (manager->tlsf != NULL)
+    {
+        manager->tlsf->fl_bitmap = 0;
+        memset(manager->tlsf->sl_bitmap, 0, sizeof(manager->tlsf->sl_bitmap));
+        memset(manager->tlsf->heads, 0xff, sizeof(manager->tlsf->heads));
+    }
 
+    // the top node becomes the one gap again, as in mem_pool_open()
+    node_pt top = _mem_get_node(manager);
+    _mem_node_set_mem(manager, top, pool->mem);
+    _mem_node_set_size(top, pool->total_size);
+    top->allocated = 0;
 
+    manager->rover = pool->mem;
+    pool->alloc_size = 0;
+    pool->num_allocs = 0;
+    pool->num_gaps = 0;
+    _mem_add_to_gap_ix(manager, pool->total_size, top);
 
-    int i;
-    if (((float) pool_mgr->pool.num_gaps/ pool_mgr->gap_ix_capacity)
-        > MEM_GAP_IX_FILL_FACTOR){
+    _mem_unlock_pool(manager);
 
+    return ALLOC_OK;
+}
 
+// Gives the whole pages inside the pool's gaps back to the OS
+// Only for POOL_MMAP pools other than SLAB, and not POOL_LOCK ones. The
+// pages are zero-filled on the next touch, so they cost nothing until an
+// allocation is carved out of them again; pool.trimmed_size counts those
+// not reused yet.
+alloc_status mem_pool_trim(pool_pt pool) {
+    pool_mgr_pt manager = (pool_mgr_pt) pool;
 
-        int item[pool_mgr->gap_ix_capacity];
+    if (!(pool->flags & POOL_MMAP) || (pool->flags & POOL_LOCK) || pool->policy == SLAB)
+    {
+        return ALLOC_FAIL;
+    }
 
+    _mem_lock_pool(manager);
 
-//        map one array to the other via indexes indicating the pointers
-        node_pt it;
-        int j;
-        for (i = 0; i < pool_mgr->gap_ix_capacity; i++) {
-            item[i] =2147483647;
-            it = pool_mgr->gap_ix[i].node;
-            if (it == &pool_mgr->node_heap[i])
-            {
-                item[i] = i;
-            }
+    if (manager->trimmed == NULL)
+    {
+        manager->trimmed = calloc((manager->mapped_size / manager->page_size + 63) / 64, sizeof(uint64_t));
+        if (manager->trimmed == NULL)
+        {
+            _mem_unlock_pool(manager);
+            return ALLOC_FAIL;
         }
+    }
 
-        gap_pt temp = realloc(pool_mgr->gap_ix, pool_mgr->gap_ix_capacity * MEM_GAP_IX_EXPAND_FACTOR
-                                                * sizeof(gap_t));
+    if (pool->policy == ARENA)
+    {
+        // everything above the top
+        _mem_decommit(manager, manager->rover, pool->total_size - pool->alloc_size);
+    }
+    else if (pool->policy == BUDDY)
+    {
+        // free blocks keep their list links at the front
+        for (unsigned k = 0; k <= manager->buddy->max_order; k++)
+        {
+            size_t block = MEM_BUDDY_MIN_BLOCK << k;
+
+            if (block <= manager->page_size)
+                continue;
+            for (char *mem = manager->buddy->heads[k]; mem != NULL; mem = ((buddy_link_pt) mem)->next)
+                _mem_decommit(manager, mem + sizeof(buddy_link_t), block - sizeof(buddy_link_t));
+        }
+    }
+    else
+    {
+        for (node_pt node = manager->node_heap; node != NULL; node = _mem_node(manager, node->next))
+        {
+            if (!node->allocated)
+                _mem_decommit(manager, _mem_node_mem(manager, node), _mem_node_size(node));
+        }
+    }
 
+    _mem_unlock_pool(manager);
 
-        //pool_mgr->gap_ix= malloc(MEM_GAP_IX_INIT_CAPACITY*sizeof(gap_t));
+    return ALLOC_OK;
+}
 
+// Allocates n segments of sizes[i] bytes into out[i], all or nothing
+// The pool is locked and its indexes are grown once for the whole batch.
+alloc_status mem_new_alloc_batch(pool_pt pool, const size_t sizes[], unsigned n, void *out[]) {
+    pool_mgr_pt manager = (pool_mgr_pt) pool;
+    unsigned i;
 
-        if (!temp)
+    // cached pools round sizes and keep their own books, and slabs and
+    // buddy pools have no node heap to grow, so these go one at a time
+    if (manager->cache_class != NULL || pool->policy == SLAB || pool->policy == BUDDY)
+    {
+        for (i = 0; i < n; i++)
         {
-            return ALLOC_FAIL;
+            out[i] = mem_new_alloc(pool, sizes[i]);
+            if (out[i] == NULL)
+            {
+                mem_del_alloc_batch(pool, out, i);
+                return ALLOC_FAIL;
+            }
         }
+        return ALLOC_OK;
+    }
 
-        pool_mgr->gap_ix = temp; // assign memory to temp
+    _mem_lock_pool(manager);
+
+    // an arena batch that fails just moves the top back
+    if (pool->policy == ARENA)
+    {
+        char *top = manager->rover;
+        unsigned num_allocs = pool->num_allocs;
 
-        //remap the memory from the array
-        for (i = 0; i < pool_mgr->gap_ix_capacity; i++) {
-            if (item[i] != 2147483647)
+        for (i = 0; i < n; i++)
+        {
+            out[i] = _mem_arena_alloc(manager, sizes[i]);
+            if (out[i] == NULL)
             {
-                pool_mgr->gap_ix[i].node = &pool_mgr->node_heap[i];
+                _mem_arena_set_top(manager, top, num_allocs);
+                break;
             }
         }
+        _mem_unlock_pool(manager);
 
+        return (i < n) ? ALLOC_FAIL : ALLOC_OK;
+    }
+
+    // each allocation may split a gap, which takes one more node
+    if (_mem_resize_node_heap(manager, n) != ALLOC_OK || _mem_resize_alloc_ix(manager, n) != ALLOC_OK)
+    {
+        _mem_unlock_pool(manager);
+        return ALLOC_FAIL;
+    }
 
+    for (i = 0; i < n; i++)
+    {
+        out[i] = _mem_new_alloc(pool, sizes[i]);
+        if (out[i] == NULL)
+            break;
+    }
+    _mem_unlock_pool(manager);
 
+    if (i < n)
+    {
+        // give back what was allocated so far
+        mem_del_alloc_batch(pool, out, i);
+        return ALLOC_FAIL;
+    }
 
+    return ALLOC_OK;
+}
 
-        for (i = pool_mgr->gap_ix_capacity; i < pool_mgr->gap_ix_capacity * MEM_GAP_IX_EXPAND_FACTOR; i++)
+// Frees n allocations at once
+// The freed segments are only merged with their neighbours and put in the
+// gap index at the end, one run of adjacent gaps at a time, instead of
+// being merged and indexed one by one. ALLOC_FAIL if any of allocs[] was
+// not an allocation of the pool; the others are still freed.
+alloc_status mem_del_alloc_batch(pool_pt pool, void *allocs[], unsigned n) {
+    pool_mgr_pt manager = (pool_mgr_pt) pool;
+    alloc_status status = ALLOC_OK;
+    unsigned i;
+
+    if (manager->cache_class != NULL || pool->policy == ARENA || pool->policy == SLAB
+        || pool->policy == BUDDY)
+    {
+        for (i = 0; i < n; i++)
         {
-            pool_mgr->gap_ix[i].node = (node_pt)malloc(sizeof(node_t));
-            pool_mgr->gap_ix[i].node->prev = NULL;
-            pool_mgr->gap_ix[i].node->next = NULL;
-            pool_mgr->gap_ix[i].node->alloc_record.size = 0;
-            pool_mgr->gap_ix[i].node->alloc_record.mem= NULL;
-            pool_mgr->gap_ix[i].node->used = 0;
-            pool_mgr->gap_ix[i].node->allocated= 0;
-            pool_mgr->gap_ix[i].size = 0;
+            if (mem_del_alloc(pool, allocs[i]) != ALLOC_OK)
+                status = ALLOC_FAIL;
         }
-        pool_mgr->gap_ix_capacity = pool_mgr->gap_ix_capacity * MEM_GAP_IX_EXPAND_FACTOR;
-
-        return ALLOC_OK;
+        return status;
     }
-    else {
+
+    unsigned *freed = malloc(n * sizeof(unsigned));
+    if (freed == NULL && n > 0)
+    {
         return ALLOC_FAIL;
     }
-}
-
-static alloc_status _mem_add_to_gap_ix(pool_mgr_pt pool_mgr,
-                                       size_t size,
-                                       node_pt node) {
+    unsigned num_freed = 0;
 
-    // expand the gap index, if necessary (call the function)
-    _mem_resize_gap_ix(pool_mgr);
+    _mem_lock_pool(manager);
 
-    // add the entry at the end
-    pool_mgr->gap_ix[pool_mgr->pool.num_gaps].node = node;
-    pool_mgr->gap_ix[pool_mgr->pool.num_gaps].size = size;
+    // first turn the allocations into gaps that are not in the gap index yet
+    for (i = 0; i < n; i++)
+    {
+        node_pt nodePtr = NULL;
+        char *mem = allocs[i];
 
-    // update metadata (num_gaps)
-    pool_mgr->pool.num_gaps++;
+        if (mem >= pool->mem && mem < pool->mem + pool->total_size)
+            nodePtr = _mem_find_alloc_ix(manager, mem);
 
-    // sort the gap index (call the function)
-    _mem_sort_gap_ix(pool_mgr);
+        if (nodePtr == NULL || nodePtr->used == 0 || nodePtr->allocated == 0)
+        {
+            printf("Node to delete not found in memory pool\n");
+            status = ALLOC_FAIL;
+            continue;
+        }
 
-    //printf("Added gap\n");
-    gapReport(pool_mgr);
+        _mem_remove_from_alloc_ix(manager, nodePtr);
+        nodePtr->allocated = 0;
+        nodePtr->gap = MEM_GAP_IX_NIL;
+        pool->num_allocs--;
+        pool->alloc_size = pool->alloc_size - _mem_node_size(nodePtr);
 
-    return ALLOC_OK;
-}
+        freed[num_freed++] = _mem_node_ix(manager, nodePtr);
+    }
 
-static alloc_status _mem_remove_from_gap_ix(pool_mgr_pt pool_mgr,
-                                            size_t size,
-                                            node_pt node) {
+    // then merge each run of adjacent gaps into its first node and index it
+    for (i = 0; i < num_freed; i++)
+    {
+        node_pt nodePtr = &manager->node_heap[freed[i]];
 
-    // find the position of the node in the gap index
-    int i = 0;
-    while (pool_mgr->gap_ix[i].node && pool_mgr->gap_ix[i].node != node) i++;
+        // already merged into an earlier run, or the head of one
+        if (nodePtr->used == 0 || nodePtr->gap != MEM_GAP_IX_NIL)
+            continue;
 
-    // loop from there to the end of the array:
-    //    pull the entries (i.e. copy over) one position up
-    //    this effectively deletes the chosen node
-    for (int j = i; j < pool_mgr->pool.num_gaps; j++) {
-        pool_mgr->gap_ix[j].node = pool_mgr->gap_ix[j+1].node;
-        pool_mgr->gap_ix[j].size = pool_mgr->gap_ix[j+1].size;
+        _mem_coalesce_gap(manager, nodePtr);
     }
 
-    // zero out the last element which is just a copy of the second-to-last
-    pool_mgr->gap_ix[pool_mgr->pool.num_gaps].node = NULL;
-    pool_mgr->gap_ix[pool_mgr->pool.num_gaps].size = 0;
+    _mem_unlock_pool(manager);
+    free(freed);
 
-    // update metadata (num_gaps)
-    pool_mgr->pool.num_gaps--;
+    return status;
+}
 
-    _mem_sort_gap_ix(pool_mgr);
+// Opens a pool of size bytes split evenly over num_shards pools, or one
+// per online CPU if num_shards is 0
+// Each thread allocates from the shard of the CPU it is running on and
+// only moves on to the other shards when that one has no room.
+sharded_pool_pt mem_sharded_pool_open(size_t size, alloc_policy policy, unsigned num_shards) {
+    if (num_shards == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_shards = (cpus > 0) ? (unsigned) cpus : 1;
+    }
+    if (size / num_shards == 0)
+    {
+        return NULL;
+    }
 
-    //printf("Removed gap\n");
-    gapReport(pool_mgr);
+    sharded_mgr_pt manager = malloc(sizeof(sharded_mgr_t));
+    if (manager == NULL)
+    {
+        return NULL;
+    }
 
-    return ALLOC_OK;
-}
+    manager->sharded.total_size = size;
+    manager->sharded.num_shards = num_shards;
+    manager->sharded.shards = calloc(num_shards, sizeof(pool_pt));
+    manager->by_address = malloc(num_shards * sizeof(pool_pt));
+    if (manager->sharded.shards == NULL || manager->by_address == NULL)
+    {
+        free(manager->sharded.shards);
+        free(manager->by_address);
+        free(manager);
+        return NULL;
+    }
 
-// note: only called by _mem_add_to_gap_ix, which appends a single entry
-static alloc_status _mem_sort_gap_ix(pool_mgr_pt pool_mgr) {
-    // the new entry is at the end, so "bubble it up"
-    // loop from num_gaps - 1 until but not including 0:
-    //    if the size of the current entry is less than the previous (u - 1)
-    //    or if the sizes are the same but the current entry points to a
-    //    node with a lower address of pool allocation address (mem)
-    //       swap them (by copying) (remember to use a temporary variable)
+    // the last shard also gets the remainder
+    for (unsigned i = 0; i < num_shards; i++)
+    {
+        size_t shard_size = size / num_shards;
+        if (i == num_shards - 1)
+            shard_size += size % num_shards;
 
-    int i = 0;
-    gap_t temp;
+        manager->sharded.shards[i] = mem_pool_open(shard_size, policy);
+        if (manager->sharded.shards[i] == NULL)
+        {
+            mem_sharded_pool_close(&manager->sharded);
+            return NULL;
+        }
 
+        // insertion sort by address
+        // note: the shards are separate objects, so compare them as integers
+        unsigned j = i;
+        while (j > 0 && (uintptr_t) manager->by_address[j - 1]->mem
+                        > (uintptr_t) manager->sharded.shards[i]->mem)
+        {
+            manager->by_address[j] = manager->by_address[j - 1];
+            j--;
+        }
+        manager->by_address[j] = manager->sharded.shards[i];
+    }
 
+    return &manager->sharded;
+}
 
+// Closes every shard; fails, closing none of them, if any still has allocations
+alloc_status mem_sharded_pool_close(sharded_pool_pt sharded) {
+    sharded_mgr_pt manager = (sharded_mgr_pt) sharded;
 
-    while (pool_mgr->gap_ix[i+1].size != 0)
+    // close nothing unless every shard can be closed, so that a failed
+    // close leaves the sharded pool as it was
+    for (unsigned i = 0; i < sharded->num_shards; i++)
     {
-        pool_mgr->gap_ix[i].size = pool_mgr->gap_ix[i].node->alloc_record.size;
-        i++;
-    }
-
+        if (sharded->shards[i] == NULL)
+            continue;
 
+        alloc_status status = _mem_pool_closable((pool_mgr_pt) sharded->shards[i]);
+        if (status != ALLOC_OK)
+            return status;
+    }
 
-    while (i != 0 && pool_mgr->gap_ix[i].size < pool_mgr->gap_ix[i-1].size )
+    for (unsigned i = 0; i < sharded->num_shards; i++)
     {
-        temp = pool_mgr->gap_ix[i];
-        pool_mgr->gap_ix[i] = pool_mgr->gap_ix[i-1];
-        pool_mgr->gap_ix[i-1] = temp;
-        i--;
+        if (sharded->shards[i] != NULL)
+            mem_pool_close(sharded->shards[i]);
     }
 
+    free(sharded->shards);
+    free(manager->by_address);
+    free(manager);
+
     return ALLOC_OK;
 }
 
+void * mem_sharded_new_alloc(sharded_pool_pt sharded, size_t size) {
+    sharded_mgr_pt manager = (sharded_mgr_pt) sharded;
+    unsigned local = _mem_shard_ix(manager);
+
+    void *alloc = mem_new_alloc(sharded->shards[local], size);
+    if (alloc != NULL || size == 0)
+    {
+        return alloc;
+    }
+
+    // steal from the neighbours, nearest first
+    for (unsigned i = 1; alloc == NULL && i < sharded->num_shards; i++)
+    {
+        alloc = mem_new_alloc(sharded->shards[(local + i) % sharded->num_shards], size);
+    }
+
+    return alloc;
+}
+
+// frees go back to whichever shard the allocation came from
+alloc_status mem_sharded_del_alloc(sharded_pool_pt sharded, void *alloc) {
+    pool_pt shard = _mem_find_shard((sharded_mgr_pt) sharded, alloc);
+
+    if (shard == NULL)
+    {
+        printf("Node to delete not found in sharded pool\n");
+        return ALLOC_FAIL;
+    }
+
+    return mem_del_alloc(shard, alloc);
+}
+
+// Returns the calling thread's cached segments to the pool
+alloc_status mem_pool_cache_flush(pool_pt pool) {
+    pool_mgr_pt manager = (pool_mgr_pt) pool;
+
+    if (manager->cache_class == NULL)
+        return ALLOC_FAIL;
+
+    cache_pt cache = _mem_thread_cache(manager, 0);
+    if (cache != NULL) {
+        _mem_lock_pool(manager);
+        _mem_cache_drain(manager, cache);
+        _mem_unlock_pool(manager);
+    }
+
+    return ALLOC_OK;
+}
+
+
+
+/***********************************/
+/*                                 */
+/* Definitions of static functions */
+/*                                 */
+/***********************************/
+// sets up the locks and adds a new pool to the store, with the store locked
+static void _mem_pool_register(pool_mgr_pt pool_mgr) {
+#ifdef MEM_POOL_THREAD_SAFE
+    pthread_mutex_init(&pool_mgr->lock, NULL);
+#endif
+
+    pool_store[pool_store_size] = pool_mgr;
+    pool_store_size++;
+}
+
+// gets size bytes of pool memory, the way the POOL_* flags ask, and sets
+// pool.mem and pool.flags
+// note: only huge pages fall back (to normal pages); a failed mmap is
+// an error rather than a quiet malloc
+static alloc_status _mem_map_pool(pool_mgr_pt pool_mgr, size_t size, unsigned flags) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t length;
+    char *mem = MAP_FAILED;
+    struct timespec start;
+
+    // locking faults the pages in anyway, and a pool faulted in up front
+    // has nothing left to commit lazily; it is always mapped, as the ends
+    // of malloc memory share pages with whatever else is on the heap
+    if (flags & POOL_LOCK)
+        flags |= POOL_PREFAULT;
+    if (flags & POOL_PREFAULT)
+    {
+        flags &= ~POOL_LAZY_COMMIT;
+        flags |= POOL_MMAP;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+
+    pool_mgr->mapped_size = 0;
+    pool_mgr->page_size = page;
+    pool_mgr->trimmed = NULL;
+    pool_mgr->reserved = NULL;
+    pool_mgr->pool.flags = POOL_DEFAULT;
+    pool_mgr->pool.trimmed_size = 0;
+    pool_mgr->pool.committed_size = size;
+    pool_mgr->pool.prefault_ns = 0;
+
+    if (!(flags & (POOL_MMAP | POOL_HUGE_PAGES | POOL_LAZY_COMMIT)))
+    {
+        pool_mgr->pool.mem = malloc(size);
+        if (pool_mgr->pool.mem == NULL)
+        {
+            return ALLOC_FAIL;
+        }
+
+        return ALLOC_OK;
+    }
+
+    // a lazy pool is only reserved address space until _mem_commit()
+    int prot = (flags & POOL_LAZY_COMMIT) ? PROT_NONE : PROT_READ | PROT_WRITE;
+    int lazy = (flags & POOL_LAZY_COMMIT) ? MAP_NORESERVE : 0;
+    int populate = 0;
+
+#ifdef MAP_POPULATE
+    // the kernel faults the mapping in faster than a touch pass can
+    if (flags & POOL_PREFAULT)
+        populate = MAP_POPULATE;
+#endif
+
+    if (size == 0 || size > SIZE_MAX - 2 * MEM_HUGE_PAGE_SIZE)
+    {
+        return ALLOC_FAIL;
+    }
+
+#ifdef MAP_HUGETLB
+    // reserved huge pages, if there are enough
+    if (flags & POOL_HUGE_PAGES)
+    {
+        length = (size + MEM_HUGE_PAGE_SIZE - 1) / MEM_HUGE_PAGE_SIZE * MEM_HUGE_PAGE_SIZE;
+        mem = mmap(NULL, length, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | lazy | populate, -1, 0);
+        if (mem != MAP_FAILED)
+        {
+            pool_mgr->pool.flags = POOL_MMAP | POOL_HUGE_PAGES | (populate ? POOL_PREFAULT : 0);
+            pool_mgr->page_size = MEM_HUGE_PAGE_SIZE;
+        }
+    }
+#endif
+
+    if (mem == MAP_FAILED)
+    {
+#ifdef MADV_HUGEPAGE
+        // transparent huge pages only back aligned huge pages, so map one
+        // more and trim the ends to put the pool on a boundary
+        // note: no MAP_POPULATE here, as that would fault in small pages
+        // before the madvise()
+        if (flags & POOL_HUGE_PAGES)
+        {
+            length = (size + MEM_HUGE_PAGE_SIZE - 1) / MEM_HUGE_PAGE_SIZE * MEM_HUGE_PAGE_SIZE;
+            char *wide = mmap(NULL, length + MEM_HUGE_PAGE_SIZE, prot,
+                              MAP_PRIVATE | MAP_ANONYMOUS | lazy, -1, 0);
+            if (wide != MAP_FAILED)
+            {
+                size_t head = (MEM_HUGE_PAGE_SIZE - (uintptr_t) wide % MEM_HUGE_PAGE_SIZE) % MEM_HUGE_PAGE_SIZE;
+
+                if (head > 0)
+                    munmap(wide, head);
+                munmap(wide + head + length, MEM_HUGE_PAGE_SIZE - head);
+                mem = wide + head;
+
+                if (madvise(mem, length, MADV_HUGEPAGE) == 0)
+                    pool_mgr->pool.flags = POOL_MMAP | POOL_HUGE_PAGES;
+            }
+        }
+#endif
+
+        if (mem == MAP_FAILED)
+        {
+            length = (size + page - 1) / page * page;
+            mem = mmap(NULL, length, prot, MAP_PRIVATE | MAP_ANONYMOUS | lazy | populate, -1, 0);
+            if (mem != MAP_FAILED && populate)
+                pool_mgr->pool.flags |= POOL_PREFAULT;
+        }
+
+        if (mem == MAP_FAILED)
+        {
+            perror("mmap");
+            return ALLOC_FAIL;
+        }
+
+        pool_mgr->pool.flags |= POOL_MMAP;
+    }
+
+    pool_mgr->pool.mem = mem;
+    pool_mgr->mapped_size = length;
+    pool_mgr->pool.committed_size = length;
+
+    // every page starts out reserved
+    if (flags & POOL_LAZY_COMMIT)
+    {
+        size_t pages = length / pool_mgr->page_size;
+
+        pool_mgr->reserved = malloc((pages + 63) / 64 * sizeof(uint64_t));
+        if (pool_mgr->reserved == NULL)
+        {
+            munmap(mem, length);
+            return ALLOC_FAIL;
+        }
+        memset(pool_mgr->reserved, 0xff, (pages + 63) / 64 * sizeof(uint64_t));
+        if (pages % 64 != 0)
+            pool_mgr->reserved[pages / 64] = ((uint64_t) 1 << (pages % 64)) - 1;
+
+        pool_mgr->pool.flags |= POOL_LAZY_COMMIT;
+        pool_mgr->pool.committed_size = 0;
+    }
+
+    return _mem_prefault_pool(pool_mgr, length, flags, &start);
+}
+
+// touches every page of the mapping that MAP_POPULATE hasn't faulted in
+// already, and mlock()s it for POOL_LOCK; pool.prefault_ns is the time
+// since start, getting the memory included
+// note: a failed mlock() (e.g. over RLIMIT_MEMLOCK) unmaps the pool and
+// fails the open, as POOL_LOCK asks for memory that is never paged out
+static alloc_status _mem_prefault_pool(pool_mgr_pt pool_mgr, size_t length, unsigned flags,
+                                       const struct timespec *start) {
+    struct timespec end;
+
+    if (!(flags & POOL_PREFAULT))
+    {
+        return ALLOC_OK;
+    }
+
+    if (!(pool_mgr->pool.flags & POOL_PREFAULT))
+    {
+        volatile char *mem = pool_mgr->pool.mem;
+
+        for (size_t offset = 0; offset < length; offset += pool_mgr->page_size)
+            mem[offset] = 0;
+        pool_mgr->pool.flags |= POOL_PREFAULT;
+    }
+
+    if (flags & POOL_LOCK)
+    {
+        if (mlock(pool_mgr->pool.mem, length) != 0)
+        {
+            perror("mlock");
+            munmap(pool_mgr->pool.mem, length);
+            pool_mgr->mapped_size = 0;
+            return ALLOC_FAIL;
+        }
+        pool_mgr->pool.flags |= POOL_LOCK;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pool_mgr->pool.prefault_ns = (unsigned long) (end.tv_sec - start->tv_sec) * 1000000000UL
+                                 + (unsigned long) end.tv_nsec - (unsigned long) start->tv_nsec;
+
+    return ALLOC_OK;
+}
+
+static void _mem_unmap_pool(pool_mgr_pt pool_mgr) {
+    if (pool_mgr->mapped_size != 0)
+    {
+        munmap(pool_mgr->pool.mem, pool_mgr->mapped_size);
+    }
+    else
+    {
+        free(pool_mgr->pool.mem);
+    }
+
+    free(pool_mgr->trimmed);
+    free(pool_mgr->reserved);
+    pool_mgr->trimmed = NULL;
+    pool_mgr->reserved = NULL;
+}
+
+// whether page p is set in a per-page bitmap, which may be NULL
+static int _mem_page_bit(const uint64_t *map, size_t p) {
+    return map != NULL && ((map[p / 64] >> (p % 64)) & 1);
+}
+
+// gives the whole pages inside [mem, mem + size) back to the OS, in runs
+// of pages not given back already (or never committed)
+static void _mem_decommit(pool_mgr_pt pool_mgr, char *mem, size_t size) {
+    size_t page = pool_mgr->page_size;
+    size_t first = ((size_t) (mem - pool_mgr->pool.mem) + page - 1) / page;
+    size_t end = ((size_t) (mem - pool_mgr->pool.mem) + size) / page;
+    size_t p = first;
+
+    while (p < end) {
+        if (_mem_page_bit(pool_mgr->trimmed, p) || _mem_page_bit(pool_mgr->reserved, p)) {
+            p++;
+            continue;
+        }
+
+        size_t run = p;
+        while (p < end && !_mem_page_bit(pool_mgr->trimmed, p) && !_mem_page_bit(pool_mgr->reserved, p)) {
+            pool_mgr->trimmed[p / 64] |= (uint64_t) 1 << (p % 64);
+            p++;
+        }
+
+        madvise(pool_mgr->pool.mem + run * page, (p - run) * page, MADV_DONTNEED);
+        pool_mgr->pool.trimmed_size += (p - run) * page;
+    }
+}
+
+// called for memory about to be handed out (or written to as a link):
+// makes reserved pages accessible, and keeps the books on trimmed pages,
+// which the OS faults back in by itself
+// note: only fails if reserved pages can't be committed
+static alloc_status _mem_commit(pool_mgr_pt pool_mgr, char *mem, size_t size) {
+    if (size == 0)
+        return ALLOC_OK;
+
+    size_t page = pool_mgr->page_size;
+    size_t p = (size_t) (mem - pool_mgr->pool.mem) / page;
+    size_t end = ((size_t) (mem - pool_mgr->pool.mem) + size - 1) / page + 1;
+
+    if (pool_mgr->pool.committed_size < pool_mgr->mapped_size
+        && _mem_commit_reserved(pool_mgr, p, end) != ALLOC_OK)
+        return ALLOC_FAIL;
+
+    if (pool_mgr->pool.trimmed_size == 0)
+        return ALLOC_OK;
+
+    while (p < end) {
+        uint64_t *word = &pool_mgr->trimmed[p / 64];
+
+        if (*word == 0) {
+            p = (p / 64 + 1) * 64;
+            continue;
+        }
+        if (*word & ((uint64_t) 1 << (p % 64))) {
+            *word &= ~((uint64_t) 1 << (p % 64));
+            pool_mgr->pool.trimmed_size -= page;
+        }
+        p++;
+    }
+
+    return ALLOC_OK;
+}
+
+// makes the reserved pages in [first, end) of a POOL_LAZY_COMMIT pool
+// accessible, going on to MEM_COMMIT_CHUNK_PAGES pages from first
+static alloc_status _mem_commit_reserved(pool_mgr_pt pool_mgr, size_t first, size_t end) {
+    size_t page = pool_mgr->page_size;
+    size_t pages = pool_mgr->mapped_size / page;
+    size_t p = first;
+
+    if (end < first + MEM_COMMIT_CHUNK_PAGES)
+        end = (first + MEM_COMMIT_CHUNK_PAGES < pages) ? first + MEM_COMMIT_CHUNK_PAGES : pages;
+
+    while (p < end) {
+        if (!_mem_page_bit(pool_mgr->reserved, p)) {
+            p++;
+            continue;
+        }
+
+        size_t run = p;
+        while (p < end && _mem_page_bit(pool_mgr->reserved, p))
+            p++;
+
+        if (mprotect(pool_mgr->pool.mem + run * page, (p - run) * page, PROT_READ | PROT_WRITE) != 0) {
+            perror("mprotect");
+            return ALLOC_FAIL;
+        }
+        for (size_t q = run; q < p; q++)
+            pool_mgr->reserved[q / 64] &= ~((uint64_t) 1 << (q % 64));
+        pool_mgr->pool.committed_size += (p - run) * page;
+    }
+
+    return ALLOC_OK;
+}
+
+// locking, compiled out unless MEM_POOL_THREAD_SAFE
+// note: the store lock is only taken by init/free/open/close, so threads
+// working in different pools never share a lock
+static void _mem_lock_store() {
+#ifdef MEM_POOL_THREAD_SAFE
+    pthread_mutex_lock(&pool_store_lock);
+#endif
+}
+
+static void _mem_unlock_store() {
+#ifdef MEM_POOL_THREAD_SAFE
+    pthread_mutex_unlock(&pool_store_lock);
+#endif
+}
+
+static void _mem_lock_pool(pool_mgr_pt pool_mgr) {
+#ifdef MEM_POOL_THREAD_SAFE
+    pthread_mutex_lock(&pool_mgr->lock);
+#else
+    (void) pool_mgr;
+#endif
+}
+
+static void _mem_unlock_pool(pool_mgr_pt pool_mgr) {
+#ifdef MEM_POOL_THREAD_SAFE
+    pthread_mutex_unlock(&pool_mgr->lock);
+#else
+    (void) pool_mgr;
+#endif
+}
+
+static alloc_status _mem_resize_pool_store() {
+    // check if necessary
+    /*
+                if (((float) pool_store_size / pool_store_capacity)
+                    > MEM_POOL_STORE_FILL_FACTOR) {...}
+     */
+    // don't forget to update capacity variables
+
+
+    if (((float) pool_store_size / pool_store_capacity) > MEM_POOL_STORE_FILL_FACTOR) {
+
+        pool_mgr_pt * temp = realloc(pool_store, pool_store_capacity * MEM_POOL_STORE_EXPAND_FACTOR
+                                                 * sizeof(pool_mgr_pt));
+
+        if (!temp)
+        {
+            return ALLOC_FAIL;
+        }
+
+        else
+        {
+            pool_store = temp;
+        }
+
+        for (unsigned i = pool_store_capacity; i < pool_store_capacity * MEM_POOL_STORE_EXPAND_FACTOR; i++)
+        {
+            pool_store[i] = NULL;
+        }
+        pool_store_capacity = MEM_POOL_STORE_EXPAND_FACTOR * pool_store_capacity;
+
+        return ALLOC_OK;
+    }
+    else
+    {
+        return ALLOC_FAIL;
+    }
+
+}
+
+
+// makes room for extra more nodes, for batches; fails only if it needs
+// to grow the heap and can't
+static alloc_status _mem_resize_node_heap(pool_mgr_pt pool_mgr, unsigned extra) {
+
+    if (((float) (pool_mgr->used_nodes + extra)/ pool_mgr->total_nodes)
+        > MEM_NODE_HEAP_FILL_FACTOR){
+
+        unsigned new_total = pool_mgr->total_nodes * MEM_NODE_HEAP_EXPAND_FACTOR;
+        while (((float) (pool_mgr->used_nodes + extra) / new_total) > MEM_NODE_HEAP_FILL_FACTOR)
+            new_total *= MEM_NODE_HEAP_EXPAND_FACTOR;
+
+        // all links into the heap are indexes, so the nodes can just move
+        node_pt temp = realloc(pool_mgr->node_heap, new_total * sizeof(node_t));
+
+        if (!temp)
+        {
+            return ALLOC_FAIL;
+        }
+
+        // the new nodes lie above fresh_nodes, so _mem_get_node() sets them up
+        pool_mgr->node_heap = temp;
+        pool_mgr->total_nodes = new_total;
+
+        return ALLOC_OK;
+    }
+    else {
+        return ALLOC_OK;
+    }
+}
+
+// segment address and size of a node, in either node layout
+static char *_mem_node_mem(pool_mgr_pt pool_mgr, const node_pt node) {
+#ifdef MEM_POOL_COMPACT
+    return pool_mgr->pool.mem + node->offset;
+#else
+    (void) pool_mgr;
+    return node->alloc_record.mem;
+#endif
+}
+
+static void _mem_node_set_mem(pool_mgr_pt pool_mgr, node_pt node, char *mem) {
+#ifdef MEM_POOL_COMPACT
+    node->offset = (uint32_t) (mem - pool_mgr->pool.mem);
+#else
+    (void) pool_mgr;
+    node->alloc_record.mem = mem;
+#endif
+}
+
+static size_t _mem_node_size(const node_pt node) {
+#ifdef MEM_POOL_COMPACT
+    return (size_t) node->size;
+#else
+    return node->alloc_record.size;
+#endif
+}
+
+static void _mem_node_set_size(node_pt node, size_t size) {
+#ifdef MEM_POOL_COMPACT
+    node->size = size;
+#else
+    node->alloc_record.size = size;
+#endif
+}
+
+// node heap index to pointer, or NULL for MEM_NODE_NIL
+// note: pointers are only good until the next _mem_resize_node_heap()
+static node_pt _mem_node(pool_mgr_pt pool_mgr, unsigned ix) {
+    return (ix == MEM_NODE_NIL) ? NULL : &pool_mgr->node_heap[ix];
+}
+
+static unsigned _mem_node_ix(pool_mgr_pt pool_mgr, node_pt node) {
+    return (unsigned) (node - pool_mgr->node_heap);
+}
+
+// takes an unused node off the free list, or the next never-used one,
+// and marks it used
+static node_pt _mem_get_node(pool_mgr_pt pool_mgr) {
+    node_pt node = _mem_node(pool_mgr, pool_mgr->free_nodes);
+
+    if (node != NULL) {
+        pool_mgr->free_nodes = node->next;
+    } else if (pool_mgr->fresh_nodes < pool_mgr->total_nodes) {
+        node = &pool_mgr->node_heap[pool_mgr->fresh_nodes++];
+        node->allocated = 0;
+    } else {
+        return NULL;
+    }
+
+    node->next = MEM_NODE_NIL;
+    node->prev = MEM_NODE_NIL;
+    node->used = 1;
+    pool_mgr->used_nodes++;
+
+    return node;
+}
+
+// clears a node that has been unlinked from the list and returns it
+// to the front of the free list
+static void _mem_put_node(pool_mgr_pt pool_mgr, node_pt node) {
+    _mem_node_set_size(node, 0);
+    node->allocated = 0;
+    node->used = 0;
+    node->prev = MEM_NODE_NIL;
+    node->next = pool_mgr->free_nodes;
+    pool_mgr->free_nodes = _mem_node_ix(pool_mgr, node);
+    pool_mgr->used_nodes--;
+}
+
+static alloc_status _mem_resize_gap_ix(pool_mgr_pt pool_mgr) {
+
+    if (((float) pool_mgr->pool.num_gaps/ pool_mgr->gap_ix_capacity)
+        > MEM_GAP_IX_FILL_FACTOR){
+
+        // the tree links are indexes, so nothing needs remapping after the move
+        gap_pt temp = realloc(pool_mgr->gap_ix, pool_mgr->gap_ix_capacity * MEM_GAP_IX_EXPAND_FACTOR
+                                                * sizeof(gap_t));
+
+        if (!temp)
+        {
+            return ALLOC_FAIL;
+        }
+
+        // the new slots lie above gap_ix_fresh, so they need no setup
+        pool_mgr->gap_ix = temp; // assign memory to temp
+        pool_mgr->gap_ix_capacity = pool_mgr->gap_ix_capacity * MEM_GAP_IX_EXPAND_FACTOR;
+
+        return ALLOC_OK;
+    }
+    else {
+        return ALLOC_FAIL;
+    }
+}
+
+/*
+ * Gap tree helpers. The tree orders gaps by size and, among equal sizes,
+ * by address, so the leftmost gap that fits is the best fit with the
+ * lowest address. FIRST_FIT and NEXT_FIT pools order gaps by address only
+ * and use max_size to find the lowest gap that fits. All of the helpers
+ * take and return gap_ix indexes.
+ */
+static int _mem_gap_ix_by_address(pool_mgr_pt pool_mgr) {
+    return pool_mgr->pool.policy == FIRST_FIT || pool_mgr->pool.policy == NEXT_FIT;
+}
+
+static char *_mem_gap_ix_mem(pool_mgr_pt pool_mgr, const gap_pt gap) {
+    return _mem_node_mem(pool_mgr, &pool_mgr->node_heap[gap->node]);
+}
+
+static int _mem_gap_ix_cmp(pool_mgr_pt pool_mgr, size_t size, const node_pt node, const gap_pt gap) {
+    char *gap_mem = _mem_gap_ix_mem(pool_mgr, gap);
+
+    if (!_mem_gap_ix_by_address(pool_mgr) && size != gap->size)
+        return (size < gap->size) ? -1 : 1;
+    char *node_mem = _mem_node_mem(pool_mgr, node);
+
+    if (node_mem != gap_mem)
+        return (node_mem < gap_mem) ? -1 : 1;
+    return 0;
+}
+
+static unsigned _mem_gap_ix_height(pool_mgr_pt pool_mgr, unsigned ix) {
+    return (ix == MEM_GAP_IX_NIL) ? 0 : pool_mgr->gap_ix[ix].height;
+}
+
+static void _mem_gap_ix_update(pool_mgr_pt pool_mgr, unsigned ix) {
+    gap_pt gap = &pool_mgr->gap_ix[ix];
+    unsigned hl = _mem_gap_ix_height(pool_mgr, gap->left);
+    unsigned hr = _mem_gap_ix_height(pool_mgr, gap->right);
+    gap->height = ((hl > hr) ? hl : hr) + 1;
+
+    gap->max_size = gap->size;
+    if (gap->left != MEM_GAP_IX_NIL && pool_mgr->gap_ix[gap->left].max_size > gap->max_size)
+        gap->max_size = pool_mgr->gap_ix[gap->left].max_size;
+    if (gap->right != MEM_GAP_IX_NIL && pool_mgr->gap_ix[gap->right].max_size > gap->max_size)
+        gap->max_size = pool_mgr->gap_ix[gap->right].max_size;
+}
+
+static unsigned _mem_gap_ix_rotate_left(pool_mgr_pt pool_mgr, unsigned ix) {
+    unsigned r = pool_mgr->gap_ix[ix].right;
+    pool_mgr->gap_ix[ix].right = pool_mgr->gap_ix[r].left;
+    pool_mgr->gap_ix[r].left = ix;
+    _mem_gap_ix_update(pool_mgr, ix);
+    _mem_gap_ix_update(pool_mgr, r);
+    return r;
+}
+
+static unsigned _mem_gap_ix_rotate_right(pool_mgr_pt pool_mgr, unsigned ix) {
+    unsigned l = pool_mgr->gap_ix[ix].left;
+    pool_mgr->gap_ix[ix].left = pool_mgr->gap_ix[l].right;
+    pool_mgr->gap_ix[l].right = ix;
+    _mem_gap_ix_update(pool_mgr, ix);
+    _mem_gap_ix_update(pool_mgr, l);
+    return l;
+}
+
+static unsigned _mem_gap_ix_balance(pool_mgr_pt pool_mgr, unsigned ix) {
+    gap_pt gap = &pool_mgr->gap_ix[ix];
+    unsigned hl = _mem_gap_ix_height(pool_mgr, gap->left);
+    unsigned hr = _mem_gap_ix_height(pool_mgr, gap->right);
+
+    if (hl > hr + 1) {
+        gap_pt l = &pool_mgr->gap_ix[gap->left];
+        if (_mem_gap_ix_height(pool_mgr, l->left) < _mem_gap_ix_height(pool_mgr, l->right))
+            gap->left = _mem_gap_ix_rotate_left(pool_mgr, gap->left);
+        return _mem_gap_ix_rotate_right(pool_mgr, ix);
+    }
+    if (hr > hl + 1) {
+        gap_pt r = &pool_mgr->gap_ix[gap->right];
+        if (_mem_gap_ix_height(pool_mgr, r->right) < _mem_gap_ix_height(pool_mgr, r->left))
+            gap->right = _mem_gap_ix_rotate_right(pool_mgr, gap->right);
+        return _mem_gap_ix_rotate_left(pool_mgr, ix);
+    }
+
+    _mem_gap_ix_update(pool_mgr, ix);
+    return ix;
+}
+
+static unsigned _mem_gap_ix_insert(pool_mgr_pt pool_mgr, unsigned root, unsigned ix) {
+    if (root == MEM_GAP_IX_NIL)
+        return ix;
+
+    gap_pt gap = &pool_mgr->gap_ix[ix];
+    if (_mem_gap_ix_cmp(pool_mgr, gap->size, &pool_mgr->node_heap[gap->node], &pool_mgr->gap_ix[root]) < 0)
+        pool_mgr->gap_ix[root].left = _mem_gap_ix_insert(pool_mgr, pool_mgr->gap_ix[root].left, ix);
+    else
+        pool_mgr->gap_ix[root].right = _mem_gap_ix_insert(pool_mgr, pool_mgr->gap_ix[root].right, ix);
+
+    return _mem_gap_ix_balance(pool_mgr, root);
+}
+
+static unsigned _mem_gap_ix_delete_min(pool_mgr_pt pool_mgr, unsigned root, unsigned *min) {
+    if (pool_mgr->gap_ix[root].left == MEM_GAP_IX_NIL) {
+        *min = root;
+        return pool_mgr->gap_ix[root].right;
+    }
+
+    pool_mgr->gap_ix[root].left = _mem_gap_ix_delete_min(pool_mgr, pool_mgr->gap_ix[root].left, min);
+    return _mem_gap_ix_balance(pool_mgr, root);
+}
+
+static unsigned _mem_gap_ix_delete(pool_mgr_pt pool_mgr, unsigned root,
+                                   size_t size, node_pt node, unsigned *removed) {
+    if (root == MEM_GAP_IX_NIL)
+        return MEM_GAP_IX_NIL;
+
+    int cmp = _mem_gap_ix_cmp(pool_mgr, size, node, &pool_mgr->gap_ix[root]);
+    if (cmp < 0) {
+        pool_mgr->gap_ix[root].left =
+                _mem_gap_ix_delete(pool_mgr, pool_mgr->gap_ix[root].left, size, node, removed);
+    } else if (cmp > 0) {
+        pool_mgr->gap_ix[root].right =
+                _mem_gap_ix_delete(pool_mgr, pool_mgr->gap_ix[root].right, size, node, removed);
+    } else {
+        unsigned left = pool_mgr->gap_ix[root].left;
+        unsigned right = pool_mgr->gap_ix[root].right;
+        unsigned min;
+
+        *removed = root;
+        if (left == MEM_GAP_IX_NIL)
+            return right;
+        if (right == MEM_GAP_IX_NIL)
+            return left;
+
+        // replace the entry with the smallest one of its right subtree
+        right = _mem_gap_ix_delete_min(pool_mgr, right, &min);
+        pool_mgr->gap_ix[min].left = left;
+        pool_mgr->gap_ix[min].right = right;
+        root = min;
+    }
+
+    return _mem_gap_ix_balance(pool_mgr, root);
+}
+
+/*
+ * TLSF helpers. A gap of size s is filed in class (fl, sl) where fl is
+ * the position of the highest bit of s and sl the next MEM_TLSF_SL_LOG2
+ * bits below it. Insert, remove and find are a few bit operations each.
+ */
+static void _mem_tlsf_mapping(size_t size, unsigned *fl, unsigned *sl) {
+    if (size < MEM_TLSF_SL_COUNT) {
+        *fl = 0;
+        *sl = (unsigned) size;
+    } else {
+        unsigned msb = 63 - (unsigned) __builtin_clzll((unsigned long long) size);
+        *fl = msb - MEM_TLSF_SL_LOG2 + 1;
+        *sl = (unsigned) (size >> (msb - MEM_TLSF_SL_LOG2)) ^ MEM_TLSF_SL_COUNT;
+    }
+}
+
+static void _mem_tlsf_insert(pool_mgr_pt pool_mgr, unsigned ix) {
+    tlsf_pt tlsf = pool_mgr->tlsf;
+    unsigned fl, sl;
+
+    _mem_tlsf_mapping(pool_mgr->gap_ix[ix].size, &fl, &sl);
+
+    // push on the front of the class list
+    unsigned head = tlsf->heads[fl][sl];
+    pool_mgr->gap_ix[ix].left = MEM_GAP_IX_NIL;
+    pool_mgr->gap_ix[ix].right = head;
+    if (head != MEM_GAP_IX_NIL)
+        pool_mgr->gap_ix[head].left = ix;
+    tlsf->heads[fl][sl] = ix;
+
+    tlsf->fl_bitmap |= (uint64_t) 1 << fl;
+    tlsf->sl_bitmap[fl] |= 1U << sl;
+}
+
+static void _mem_tlsf_remove(pool_mgr_pt pool_mgr, unsigned ix) {
+    tlsf_pt tlsf = pool_mgr->tlsf;
+    gap_pt gap = &pool_mgr->gap_ix[ix];
+    unsigned fl, sl;
+
+    _mem_tlsf_mapping(gap->size, &fl, &sl);
+
+    if (gap->left != MEM_GAP_IX_NIL)
+        pool_mgr->gap_ix[gap->left].right = gap->right;
+    else
+        tlsf->heads[fl][sl] = gap->right;
+    if (gap->right != MEM_GAP_IX_NIL)
+        pool_mgr->gap_ix[gap->right].left = gap->left;
+
+    // clear the bits of a class that became empty
+    if (tlsf->heads[fl][sl] == MEM_GAP_IX_NIL) {
+        tlsf->sl_bitmap[fl] &= ~(1U << sl);
+        if (tlsf->sl_bitmap[fl] == 0)
+            tlsf->fl_bitmap &= ~((uint64_t) 1 << fl);
+    }
+}
+
+// returns the head of the first non-empty class whose gaps are all at
+// least size bytes, or MEM_GAP_IX_NIL; if there is none, the head of the
+// class of size itself is tried as well, so an exact fit isn't missed
+static unsigned _mem_tlsf_find(pool_mgr_pt pool_mgr, size_t size) {
+    tlsf_pt tlsf = pool_mgr->tlsf;
+    size_t rounded = size;
+    unsigned fl, sl;
+
+    // round up to the next class boundary
+    if (size >= MEM_TLSF_SL_COUNT) {
+        unsigned msb = 63 - (unsigned) __builtin_clzll((unsigned long long) size);
+        rounded = size + ((size_t) 1 << (msb - MEM_TLSF_SL_LOG2)) - 1;
+    }
+
+    if (rounded >= size) {
+        _mem_tlsf_mapping(rounded, &fl, &sl);
+
+        unsigned sl_map = tlsf->sl_bitmap[fl] & (~0U << sl);
+        if (sl_map == 0) {
+            uint64_t fl_map = (fl + 1 < MEM_TLSF_FL_COUNT) ?
+                              tlsf->fl_bitmap & (~(uint64_t) 0 << (fl + 1)) : 0;
+            if (fl_map != 0) {
+                fl = (unsigned) __builtin_ctzll(fl_map);
+                sl_map = tlsf->sl_bitmap[fl];
+            }
+        }
+        if (sl_map != 0)
+            return tlsf->heads[fl][__builtin_ctz(sl_map)];
+    }
+
+    _mem_tlsf_mapping(size, &fl, &sl);
+    unsigned head = tlsf->heads[fl][sl];
+    if (head != MEM_GAP_IX_NIL && pool_mgr->gap_ix[head].size >= size)
+        return head;
+
+    return MEM_GAP_IX_NIL;
+}
+
+static alloc_status _mem_add_to_gap_ix(pool_mgr_pt pool_mgr,
+                                       size_t size,
+                                       node_pt node) {
+
+    // expand the gap index, if necessary (call the function)
+    _mem_resize_gap_ix(pool_mgr);
+
+    // take an unused slot off the free list, or the next never-used one
+    unsigned ix = pool_mgr->gap_ix_free;
+    if (ix != MEM_GAP_IX_NIL) {
+        pool_mgr->gap_ix_free = pool_mgr->gap_ix[ix].left;
+    } else if (pool_mgr->gap_ix_fresh < pool_mgr->gap_ix_capacity) {
+        ix = pool_mgr->gap_ix_fresh++;
+    } else {
+        return ALLOC_FAIL;
+    }
+
+    pool_mgr->gap_ix[ix].node = _mem_node_ix(pool_mgr, node);
+    pool_mgr->gap_ix[ix].size = size;
+    pool_mgr->gap_ix[ix].max_size = size;
+    pool_mgr->gap_ix[ix].left = MEM_GAP_IX_NIL;
+    pool_mgr->gap_ix[ix].right = MEM_GAP_IX_NIL;
+    pool_mgr->gap_ix[ix].height = 1;
+    node->gap = ix;
+
+    // insert it in the tree, or in its size class list for TLSF
+    if (pool_mgr->tlsf != NULL)
+        _mem_tlsf_insert(pool_mgr, ix);
+    else
+        pool_mgr->gap_ix_root = _mem_gap_ix_insert(pool_mgr, pool_mgr->gap_ix_root, ix);
+
+    // update metadata (num_gaps)
+    pool_mgr->pool.num_gaps++;
+
+    //printf("Added gap\n");
+    gapReport(pool_mgr);
+
+    return ALLOC_OK;
+}
+
+static alloc_status _mem_remove_from_gap_ix(pool_mgr_pt pool_mgr,
+                                            size_t size,
+                                            node_pt node) {
+
+    // find the entry for the node and unlink it
+    unsigned ix = MEM_GAP_IX_NIL;
+
+    if (pool_mgr->tlsf != NULL) {
+        // the node knows its slot, so there's nothing to search
+        if (node->allocated == 0 && node->gap < pool_mgr->gap_ix_fresh &&
+            pool_mgr->gap_ix[node->gap].height != 0 &&
+            pool_mgr->gap_ix[node->gap].node == _mem_node_ix(pool_mgr, node)) {
+            ix = node->gap;
+            _mem_tlsf_remove(pool_mgr, ix);
+        }
+    } else {
+        pool_mgr->gap_ix_root = _mem_gap_ix_delete(pool_mgr, pool_mgr->gap_ix_root, size, node, &ix);
+    }
+
+    if (ix == MEM_GAP_IX_NIL) {
+        return ALLOC_FAIL;
+    }
+
+    // return the slot to the free list
+    pool_mgr->gap_ix[ix].node = MEM_NODE_NIL;
+    pool_mgr->gap_ix[ix].size = 0;
+    pool_mgr->gap_ix[ix].height = 0;
+    pool_mgr->gap_ix[ix].right = MEM_GAP_IX_NIL;
+    pool_mgr->gap_ix[ix].left = pool_mgr->gap_ix_free;
+    pool_mgr->gap_ix_free = ix;
+
+    // update metadata (num_gaps)
+    pool_mgr->pool.num_gaps--;
+
+    //printf("Removed gap\n");
+    gapReport(pool_mgr);
+
+    return ALLOC_OK;
+}
+
+// returns the index of the smallest gap of at least size bytes
+// (lowest address among equal sizes), or MEM_GAP_IX_NIL if none fits
+static unsigned _mem_find_gap_ix(pool_mgr_pt pool_mgr, size_t size) {
+    unsigned ix = pool_mgr->gap_ix_root;
+    unsigned found = MEM_GAP_IX_NIL;
+
+    while (ix != MEM_GAP_IX_NIL) {
+        if (pool_mgr->gap_ix[ix].size >= size) {
+            found = ix;
+            ix = pool_mgr->gap_ix[ix].left;
+        } else {
+            ix = pool_mgr->gap_ix[ix].right;
+        }
+    }
+
+    return found;
+}
+
+/*
+ * The allocation index is an open-addressing hash table (linear probing)
+ * from an allocation's address to the index of its node in the node heap.
+ * Indexes, unlike node pointers, stay valid when the node heap is expanded.
+ */
+static unsigned _mem_alloc_ix_hash(pool_mgr_pt pool_mgr, const char *mem) {
+    uint64_t h = (uint64_t) (mem - pool_mgr->pool.mem) * 0x9E3779B97F4A7C15ULL;
+    return (unsigned) (h >> 32) & (pool_mgr->alloc_ix_capacity - 1);
+}
+
+static void _mem_alloc_ix_insert(pool_mgr_pt pool_mgr, unsigned node_ix) {
+    unsigned mask = pool_mgr->alloc_ix_capacity - 1;
+    unsigned i = _mem_alloc_ix_hash(pool_mgr, _mem_node_mem(pool_mgr, &pool_mgr->node_heap[node_ix]));
+
+    while (pool_mgr->alloc_ix[i] != MEM_NODE_NIL)
+        i = (i + 1) & mask;
+    pool_mgr->alloc_ix[i] = node_ix;
+}
+
+// returns the index of the lowest-address gap of at least size bytes in
+// the subtree ix of an address-ordered gap tree, or MEM_GAP_IX_NIL
+static unsigned _mem_find_first_gap_ix(pool_mgr_pt pool_mgr, unsigned ix, size_t size) {
+    if (ix == MEM_GAP_IX_NIL || pool_mgr->gap_ix[ix].max_size < size)
+        return MEM_GAP_IX_NIL;
+
+    // the subtree under ix always holds a gap that fits
+    while (1) {
+        gap_pt gap = &pool_mgr->gap_ix[ix];
+
+        if (gap->left != MEM_GAP_IX_NIL && pool_mgr->gap_ix[gap->left].max_size >= size)
+            ix = gap->left;
+        else if (gap->size >= size)
+            return ix;
+        else
+            ix = gap->right;
+    }
+}
+
+// same, but only among the gaps at or above from
+static unsigned _mem_find_first_gap_ix_from(pool_mgr_pt pool_mgr, unsigned ix,
+                                            const char *from, size_t size) {
+    while (ix != MEM_GAP_IX_NIL && pool_mgr->gap_ix[ix].max_size >= size) {
+        gap_pt gap = &pool_mgr->gap_ix[ix];
+
+        if (_mem_gap_ix_mem(pool_mgr, gap) < from) {
+            ix = gap->right;
+            continue;
+        }
+
+        // everything to the right is above from as well
+        unsigned found = _mem_find_first_gap_ix_from(pool_mgr, gap->left, from, size);
+        if (found != MEM_GAP_IX_NIL)
+            return found;
+        if (gap->size >= size)
+            return ix;
+        return _mem_find_first_gap_ix(pool_mgr, gap->right, size);
+    }
+
+    return MEM_GAP_IX_NIL;
+}
+
+// returns the first gap in the tree's order, so by address or by size,
+// that fits size bytes once its start is rounded up to alignment
+// note: max_size only says a subtree may hold a fit, so this can visit
+// every gap of at least size bytes
+static unsigned _mem_find_aligned_gap_ix(pool_mgr_pt pool_mgr, unsigned ix, size_t size, size_t alignment) {
+    while (ix != MEM_GAP_IX_NIL && pool_mgr->gap_ix[ix].max_size >= size) {
+        gap_pt gap = &pool_mgr->gap_ix[ix];
+
+        unsigned found = _mem_find_aligned_gap_ix(pool_mgr, gap->left, size, alignment);
+        if (found != MEM_GAP_IX_NIL)
+            return found;
+        if (gap->size >= size
+            && gap->size - size >= _mem_align_pad(_mem_gap_ix_mem(pool_mgr, gap), alignment))
+            return ix;
+        ix = gap->right;
+    }
+
+    return MEM_GAP_IX_NIL;
+}
+
+// bytes from mem up to the next multiple of alignment
+static size_t _mem_align_pad(const char *mem, size_t alignment) {
+    return (alignment - (size_t) ((uintptr_t) mem % alignment)) % alignment;
+}
+
+// returns the NEXT_FIT gap for size bytes: the first one that fits going
+// up from the rover, wrapping around to the top of the pool
+static unsigned _mem_find_next_gap_ix(pool_mgr_pt pool_mgr, size_t size) {
+    const char *rover = pool_mgr->rover;
+    unsigned ix = pool_mgr->gap_ix_root;
+    unsigned below = MEM_GAP_IX_NIL;
+
+    // a gap may have grown over the rover by merging with its neighbours,
+    // in which case it is where the search resumes
+    while (ix != MEM_GAP_IX_NIL) {
+        if (_mem_gap_ix_mem(pool_mgr, &pool_mgr->gap_ix[ix]) < rover) {
+            below = ix;
+            ix = pool_mgr->gap_ix[ix].right;
+        } else {
+            ix = pool_mgr->gap_ix[ix].left;
+        }
+    }
+    if (below != MEM_GAP_IX_NIL && pool_mgr->gap_ix[below].size >= size &&
+        _mem_gap_ix_mem(pool_mgr, &pool_mgr->gap_ix[below]) + pool_mgr->gap_ix[below].size > rover)
+        return below;
+
+    ix = _mem_find_first_gap_ix_from(pool_mgr, pool_mgr->gap_ix_root, rover, size);
+    if (ix == MEM_GAP_IX_NIL)
+        ix = _mem_find_first_gap_ix(pool_mgr, pool_mgr->gap_ix_root, size);
+
+    return ix;
+}
+
+// makes room for extra more allocations, rehashing at most once; fails
+// only if it needs to grow the index and can't
+static alloc_status _mem_resize_alloc_ix(pool_mgr_pt pool_mgr, unsigned extra) {
+    if (((float) (pool_mgr->pool.num_allocs + extra) / pool_mgr->alloc_ix_capacity)
+        > MEM_ALLOC_IX_FILL_FACTOR) {
+
+        unsigned *old_ix = pool_mgr->alloc_ix;
+        unsigned old_capacity = pool_mgr->alloc_ix_capacity;
+        unsigned new_capacity = old_capacity * MEM_ALLOC_IX_EXPAND_FACTOR;
+        unsigned i;
+
+        while (((float) (pool_mgr->pool.num_allocs + extra) / new_capacity) > MEM_ALLOC_IX_FILL_FACTOR)
+            new_capacity *= MEM_ALLOC_IX_EXPAND_FACTOR;
+
+        unsigned *temp = malloc(new_capacity * sizeof(unsigned));
+
+        if (!temp)
+        {
+            return ALLOC_FAIL;
+        }
+
+        for (i = 0; i < new_capacity; i++)
+            temp[i] = MEM_NODE_NIL;
+
+        // rehash the entries into the new table
+        pool_mgr->alloc_ix = temp;
+        pool_mgr->alloc_ix_capacity = new_capacity;
+        for (i = 0; i < old_capacity; i++) {
+            if (old_ix[i] != MEM_NODE_NIL)
+                _mem_alloc_ix_insert(pool_mgr, old_ix[i]);
+        }
+        free(old_ix);
+
+        return ALLOC_OK;
+    }
+    else {
+        return ALLOC_OK;
+    }
+}
+
+static void _mem_add_to_alloc_ix(pool_mgr_pt pool_mgr, node_pt node) {
+    _mem_alloc_ix_insert(pool_mgr, _mem_node_ix(pool_mgr, node));
+}
+
+static void _mem_remove_from_alloc_ix(pool_mgr_pt pool_mgr, node_pt node) {
+    unsigned mask = pool_mgr->alloc_ix_capacity - 1;
+    unsigned node_ix = _mem_node_ix(pool_mgr, node);
+    unsigned i = _mem_alloc_ix_hash(pool_mgr, _mem_node_mem(pool_mgr, node));
+
+    while (pool_mgr->alloc_ix[i] != node_ix) {
+        if (pool_mgr->alloc_ix[i] == MEM_NODE_NIL)
+            return;
+        i = (i + 1) & mask;
+    }
+
+    // shift back the entries that follow in the probe sequence, so that
+    // lookups don't stop at the hole
+    unsigned j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (pool_mgr->alloc_ix[j] == MEM_NODE_NIL)
+            break;
+
+        unsigned k = _mem_alloc_ix_hash(pool_mgr,
+                                        _mem_node_mem(pool_mgr, &pool_mgr->node_heap[pool_mgr->alloc_ix[j]]));
+
+        // leave the entry if its home slot k is cyclically in (i, j]
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+
+        pool_mgr->alloc_ix[i] = pool_mgr->alloc_ix[j];
+        i = j;
+    }
+    pool_mgr->alloc_ix[i] = MEM_NODE_NIL;
+}
+
+static node_pt _mem_find_alloc_ix(pool_mgr_pt pool_mgr, const char *mem) {
+    unsigned mask = pool_mgr->alloc_ix_capacity - 1;
+    unsigned i = _mem_alloc_ix_hash(pool_mgr, mem);
+
+    while (pool_mgr->alloc_ix[i] != MEM_NODE_NIL) {
+        node_pt node = &pool_mgr->node_heap[pool_mgr->alloc_ix[i]];
+        if (_mem_node_mem(pool_mgr, node) == mem)
+            return node;
+        i = (i + 1) & mask;
+    }
+
+    return NULL;
+}
+
 static alloc_status _mem_invalidate_gap_ix(pool_mgr_pt pool_mgr) {
     return ALLOC_FAIL;
-}
\ No newline at end of file
+}
+
+/*
+ * Thread caches. Only the owning thread touches a cache between refills
+ * and flushes, so the fast paths take no lock; the pool lock is taken to
+ * move a batch of segments between a cache and the pool.
+ */
+
+// finds, or with create makes, the calling thread's cache for the pool
+// note: if the thread uses more than MEM_CACHE_THREAD_POOLS cached pools,
+// the oldest entry is dropped and its segments wait for mem_pool_close()
+static cache_pt _mem_thread_cache(pool_mgr_pt pool_mgr, int create) {
+    for (unsigned i = 0; i < MEM_CACHE_THREAD_POOLS; i++) {
+        if (thread_caches[i].pool == pool_mgr && thread_caches[i].epoch == pool_mgr->cache_epoch)
+            return thread_caches[i].cache;
+    }
+
+    if (!create)
+        return NULL;
+
+    cache_pt cache = calloc(1, sizeof(cache_t));
+    if (cache == NULL)
+        return NULL;
+
+    _mem_lock_pool(pool_mgr);
+    cache->next = pool_mgr->caches;
+    pool_mgr->caches = cache;
+    _mem_unlock_pool(pool_mgr);
+
+    unsigned i = thread_caches_next++ % MEM_CACHE_THREAD_POOLS;
+    thread_caches[i].pool = pool_mgr;
+    thread_caches[i].epoch = pool_mgr->cache_epoch;
+    thread_caches[i].cache = cache;
+
+    return cache;
+}
+
+// adds a cache's counters to the pool's, with the pool locked
+static void _mem_cache_fold_stats(pool_mgr_pt pool_mgr, cache_pt cache) {
+    pool_mgr->pool.cache_hits += cache->hits;
+    pool_mgr->pool.cache_misses += cache->misses;
+    pool_mgr->pool.cache_flushes += cache->flushes;
+    cache->hits = cache->misses = cache->flushes = 0;
+}
+
+// size is a whole number of granules, at most MEM_CACHE_CLASSES of them
+static void *_mem_cache_alloc(pool_mgr_pt pool_mgr, size_t size) {
+    unsigned cls = (unsigned) (size / MEM_CACHE_GRANULE) - 1;
+    cache_pt cache = _mem_thread_cache(pool_mgr, 1);
+
+    if (cache == NULL) {
+        _mem_lock_pool(pool_mgr);
+        void *alloc = _mem_new_alloc(&pool_mgr->pool, size);
+        _mem_unlock_pool(pool_mgr);
+        return alloc;
+    }
+
+    if (cache->count[cls] > 0) {
+        cache->hits++;
+        return _mem_cache_pop(pool_mgr, cache, cls);
+    }
+
+    // refill half a magazine, so the next few frees don't flush straight back
+    cache->misses++;
+    _mem_lock_pool(pool_mgr);
+    while (cache->count[cls] < MEM_CACHE_MAGAZINE / 2) {
+        char *mem = _mem_new_alloc(&pool_mgr->pool, size);
+        if (mem == NULL)
+            break;
+        pool_mgr->cache_class[(mem - pool_mgr->pool.mem) / MEM_CACHE_GRANULE]
+            = (unsigned char) (cls + 1) | MEM_CACHE_IN_MAGAZINE;
+        cache->slots[cls][cache->count[cls]++] = mem;
+    }
+    _mem_cache_fold_stats(pool_mgr, cache);
+    _mem_unlock_pool(pool_mgr);
+
+    if (cache->count[cls] == 0)
+        return NULL;
+
+    return _mem_cache_pop(pool_mgr, cache, cls);
+}
+
+// hands out the newest segment of a non-empty magazine
+static void *_mem_cache_pop(pool_mgr_pt pool_mgr, cache_pt cache, unsigned cls) {
+    char *mem = cache->slots[cls][--cache->count[cls]];
+
+    pool_mgr->cache_class[(mem - pool_mgr->pool.mem) / MEM_CACHE_GRANULE] &= (unsigned char) ~MEM_CACHE_IN_MAGAZINE;
+
+    return mem;
+}
+
+// ALLOC_FAIL if alloc did not come from a thread cache, ALLOC_CALLED_AGAIN
+// if it is in a magazine already
+// note: only segments handed out by a cache have a cache_class entry, so
+// the entry vouches for the handle without a look in the allocation index
+static alloc_status _mem_cache_free(pool_mgr_pt pool_mgr, void *alloc) {
+    char *mem = alloc;
+
+    if (mem < pool_mgr->pool.mem || mem >= pool_mgr->pool.mem + pool_mgr->pool.total_size)
+        return ALLOC_FAIL;
+
+    size_t offset = (size_t) (mem - pool_mgr->pool.mem);
+    if (offset % MEM_CACHE_GRANULE != 0 || pool_mgr->cache_class[offset / MEM_CACHE_GRANULE] == 0)
+        return ALLOC_FAIL;
+    if (pool_mgr->cache_class[offset / MEM_CACHE_GRANULE] & MEM_CACHE_IN_MAGAZINE)
+        return ALLOC_CALLED_AGAIN;
+
+    unsigned cls = pool_mgr->cache_class[offset / MEM_CACHE_GRANULE] - 1u;
+    cache_pt cache = _mem_thread_cache(pool_mgr, 1);
+    if (cache == NULL)
+        return ALLOC_FAIL;
+
+    // when the magazine is full, hand its older half back to the pool
+    if (cache->count[cls] == MEM_CACHE_MAGAZINE) {
+        _mem_lock_pool(pool_mgr);
+        _mem_cache_flush_class(pool_mgr, cache, cls, MEM_CACHE_MAGAZINE / 2);
+        cache->flushes++;
+        _mem_cache_fold_stats(pool_mgr, cache);
+        _mem_unlock_pool(pool_mgr);
+    }
+
+    pool_mgr->cache_class[offset / MEM_CACHE_GRANULE] |= MEM_CACHE_IN_MAGAZINE;
+    cache->slots[cls][cache->count[cls]++] = mem;
+
+    return ALLOC_OK;
+}
+
+// frees the n oldest segments of a magazine, with the pool locked
+static void _mem_cache_flush_class(pool_mgr_pt pool_mgr, cache_pt cache, unsigned cls, unsigned n) {
+    char **slots = cache->slots[cls];
+
+    for (unsigned i = 0; i < n; i++) {
+        pool_mgr->cache_class[(slots[i] - pool_mgr->pool.mem) / MEM_CACHE_GRANULE] = 0;
+        _mem_del_alloc(&pool_mgr->pool, slots[i]);
+    }
+
+    memmove(slots, slots + n, (cache->count[cls] - n) * sizeof(char *));
+    cache->count[cls] -= n;
+}
+
+// empties every magazine of a cache, with the pool locked
+static void _mem_cache_drain(pool_mgr_pt pool_mgr, cache_pt cache) {
+    for (unsigned cls = 0; cls < MEM_CACHE_CLASSES; cls++) {
+        if (cache->count[cls] > 0) {
+            _mem_cache_flush_class(pool_mgr, cache, cls, cache->count[cls]);
+            cache->flushes++;
+        }
+    }
+    _mem_cache_fold_stats(pool_mgr, cache);
+}
+
+/*
+ * Sharded pools.
+ */
+
+// the calling thread's home shard: its CPU where the platform can tell,
+// otherwise a hash of the thread
+static unsigned _mem_shard_ix(sharded_mgr_pt sharded_mgr) {
+    static _Thread_local char thread_tag;
+    unsigned num_shards = sharded_mgr->sharded.num_shards;
+
+#ifdef __linux__
+    int cpu = sched_getcpu();
+    if (cpu >= 0)
+        return (unsigned) cpu % num_shards;
+#endif
+
+    // every thread has its own thread_tag, at its own address
+    uint64_t h = (uint64_t) (uintptr_t) &thread_tag * 0x9E3779B97F4A7C15ULL;
+    return (unsigned) (h >> 32) % num_shards;
+}
+
+// binary search of the shards by address, NULL if mem is in none of them
+static pool_pt _mem_find_shard(sharded_mgr_pt sharded_mgr, const char *mem) {
+    unsigned lo = 0, hi = sharded_mgr->sharded.num_shards;
+
+    // find the last shard starting at or below mem
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if ((uintptr_t) sharded_mgr->by_address[mid]->mem <= (uintptr_t) mem)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return NULL;
+
+    pool_pt shard = sharded_mgr->by_address[lo - 1];
+    if ((uintptr_t) mem >= (uintptr_t) shard->mem + shard->total_size)
+        return NULL;
+
+    return shard;
+}
+
+/*
+ * Batch free.
+ */
+
+// merges the run of gaps around node into the run's first node and adds
+// that to the gap index, with the pool locked
+// note: gaps freed by mem_del_alloc_batch() and not yet merged have
+// gap == MEM_GAP_IX_NIL, all others are in the gap index
+static void _mem_coalesce_gap(pool_mgr_pt pool_mgr, node_pt node) {
+    node_pt head = node;
+    node_pt prev = _mem_node(pool_mgr, head->prev);
+
+    while (prev != NULL && prev->allocated == 0) {
+        head = prev;
+        prev = _mem_node(pool_mgr, head->prev);
+    }
+
+    if (head->gap != MEM_GAP_IX_NIL)
+        _mem_remove_from_gap_ix(pool_mgr, _mem_node_size(head), head);
+
+    node_pt next = _mem_node(pool_mgr, head->next);
+    while (next != NULL && next->allocated == 0) {
+        if (next->gap != MEM_GAP_IX_NIL)
+            _mem_remove_from_gap_ix(pool_mgr, _mem_node_size(next), next);
+
+        _mem_node_set_size(head, _mem_node_size(head) + _mem_node_size(next));
+
+        // unlink and retire the absorbed node
+        head->next = next->next;
+        if (next->next != MEM_NODE_NIL)
+            pool_mgr->node_heap[next->next].prev = _mem_node_ix(pool_mgr, head);
+        _mem_put_node(pool_mgr, next);
+
+        next = _mem_node(pool_mgr, head->next);
+    }
+
+    _mem_add_to_gap_ix(pool_mgr, _mem_node_size(head), head);
+}
+
+/*
+ * Arenas. An ARENA pool hands out memory from the bottom up by moving
+ * rover, and only gets it back when every allocation is freed, or in
+ * stack order with mem_pool_release_to_mark(). The node heap and the gap
+ * index keep the one gap mem_pool_open() made, so mem_pool_close() and
+ * mem_pool_reset() work as for other pools.
+ */
+
+// moves the top, keeping the pool_t counters in step, with the pool locked
+static void _mem_arena_set_top(pool_mgr_pt pool_mgr, char *top, unsigned num_allocs) {
+    pool_mgr->rover = top;
+    pool_mgr->pool.num_allocs = num_allocs;
+    pool_mgr->pool.alloc_size = (size_t) (top - pool_mgr->pool.mem);
+    pool_mgr->pool.num_gaps = (pool_mgr->pool.alloc_size < pool_mgr->pool.total_size) ? 1 : 0;
+}
+
+static void *_mem_arena_alloc(pool_mgr_pt pool_mgr, size_t size) {
+    char *mem = pool_mgr->rover;
+
+    if (size == 0 || size > pool_mgr->pool.total_size - pool_mgr->pool.alloc_size
+        || _mem_commit(pool_mgr, mem, size) != ALLOC_OK) {
+        return NULL;
+    }
+
+    _mem_arena_set_top(pool_mgr, mem + size, pool_mgr->pool.num_allocs + 1);
+
+    return mem;
+}
+
+// note: an arena can't tell a double free from a free, it only counts them
+static alloc_status _mem_arena_free(pool_mgr_pt pool_mgr, void *alloc) {
+    char *mem = alloc;
+
+    if (mem < pool_mgr->pool.mem || mem >= pool_mgr->rover || pool_mgr->pool.num_allocs == 0) {
+        printf("Node to delete not found in memory pool\n");
+        return ALLOC_FAIL;
+    }
+
+    // once the last allocation is gone the arena starts over
+    if (pool_mgr->pool.num_allocs == 1)
+        _mem_arena_set_top(pool_mgr, pool_mgr->pool.mem, 0);
+    else
+        pool_mgr->pool.num_allocs--;
+
+    return ALLOC_OK;
+}
+
+/*
+ * Slabs.
+ */
+
+// whether object i is allocated; objects past either end count as
+// allocated, since the ends of the pool aren't gaps
+static int _mem_slab_bit(slab_pt slab, long i) {
+    if (i < 0 || i >= (long) slab->count)
+        return 1;
+    return (int) ((slab->bitmap[i / 64] >> (i % 64)) & 1);
+}
+
+static void *_mem_slab_alloc(pool_mgr_pt pool_mgr, size_t size) {
+    slab_pt slab = pool_mgr->slab;
+    unsigned i;
+
+    if (size == 0 || size > slab->object_size) {
+        return NULL;
+    }
+
+    // reuse the last freed object, else take a fresh one
+    if (slab->free_head != MEM_NODE_NIL) {
+        i = slab->free_head;
+        memcpy(&slab->free_head, pool_mgr->pool.mem + (size_t) i * slab->stride, sizeof(unsigned));
+    } else if (slab->fresh < slab->count) {
+        i = slab->fresh++;
+    } else {
+        return NULL;
+    }
+
+    // splitting a gap makes two, filling one in makes none
+    int left = _mem_slab_bit(slab, (long) i - 1), right = _mem_slab_bit(slab, (long) i + 1);
+    if (!left && !right)
+        pool_mgr->pool.num_gaps++;
+    else if (left && right)
+        pool_mgr->pool.num_gaps--;
+
+    slab->bitmap[i / 64] |= (uint64_t) 1 << (i % 64);
+    pool_mgr->pool.num_allocs++;
+    pool_mgr->pool.alloc_size += slab->stride;
+
+    return pool_mgr->pool.mem + (size_t) i * slab->stride;
+}
+
+static alloc_status _mem_slab_free(pool_mgr_pt pool_mgr, void *alloc) {
+    slab_pt slab = pool_mgr->slab;
+    char *mem = alloc;
+
+    if (mem < pool_mgr->pool.mem || mem >= pool_mgr->pool.mem + pool_mgr->pool.total_size
+        || (size_t) (mem - pool_mgr->pool.mem) % slab->stride != 0) {
+        printf("Node to delete not found in memory pool\n");
+        return ALLOC_FAIL;
+    }
+
+    unsigned i = (unsigned) ((size_t) (mem - pool_mgr->pool.mem) / slab->stride);
+    if (!_mem_slab_bit(slab, i)) {
+        printf("Node to delete not found in memory pool\n");
+        return ALLOC_FAIL;
+    }
+
+    slab->bitmap[i / 64] &= ~((uint64_t) 1 << (i % 64));
+    pool_mgr->pool.num_allocs--;
+    pool_mgr->pool.alloc_size -= slab->stride;
+
+    int left = _mem_slab_bit(slab, (long) i - 1), right = _mem_slab_bit(slab, (long) i + 1);
+    if (left && right)
+        pool_mgr->pool.num_gaps++;
+    else if (!left && !right)
+        pool_mgr->pool.num_gaps--;
+
+    memcpy(mem, &slab->free_head, sizeof(unsigned));
+    slab->free_head = i;
+
+    return ALLOC_OK;
+}
+
+static void _mem_slab_reset(pool_mgr_pt pool_mgr) {
+    slab_pt slab = pool_mgr->slab;
+
+    memset(slab->bitmap, 0, (slab->count + 63) / 64 * sizeof(uint64_t));
+    slab->fresh = 0;
+    slab->free_head = MEM_NODE_NIL;
+
+    pool_mgr->pool.num_allocs = 0;
+    pool_mgr->pool.alloc_size = 0;
+    pool_mgr->pool.num_gaps = 1;
+}
+
+/*
+ * Buddy pools. Every block has one buddy, the other half of the block
+ * of the next order up, found by flipping one bit of its unit index, so
+ * a freed block merges upward while its buddy is free and whole, and
+ * never has to look for its neighbours.
+ */
+
+// whether a free (or allocated) block of the order starts at the unit
+static int _mem_buddy_bit(buddy_pt buddy, int allocated, unsigned order, size_t unit) {
+    const uint64_t *map = buddy->bitmap + (allocated ? buddy->words : 0) + buddy->base[order];
+    size_t i = unit >> order;
+
+    return (int) ((map[i / 64] >> (i % 64)) & 1);
+}
+
+static void _mem_buddy_flip(buddy_pt buddy, int allocated, unsigned order, size_t unit) {
+    uint64_t *map = buddy->bitmap + (allocated ? buddy->words : 0) + buddy->base[order];
+    size_t i = unit >> order;
+
+    map[i / 64] ^= (uint64_t) 1 << (i % 64);
+}
+
+// the order of the block that starts at the unit, or MEM_BUDDY_ORDERS if
+// the unit is inside a block
+static unsigned _mem_buddy_order(buddy_pt buddy, size_t unit, int *allocated) {
+    unsigned k;
+
+    for (k = 0; k <= buddy->max_order; k++) {
+        size_t block = (size_t) 1 << k;
+
+        if ((unit & (block - 1)) != 0 || unit + block > buddy->units)
+            break;
+        if (_mem_buddy_bit(buddy, 0, k, unit)) {
+            *allocated = 0;
+            return k;
+        }
+        if (_mem_buddy_bit(buddy, 1, k, unit)) {
+            *allocated = 1;
+            return k;
+        }
+    }
+
+    return MEM_BUDDY_ORDERS;
+}
+
+// whether the unit is part of a free block; units past either end count
+// as allocated, since the ends of the pool aren't gaps
+static int _mem_buddy_is_free(buddy_pt buddy, size_t unit) {
+    unsigned k;
+
+    if (unit >= buddy->units)
+        return 0;
+
+    // the blocks that can hold the unit start at it with its low bits cleared
+    for (k = 0; k <= buddy->max_order; k++) {
+        size_t block = (size_t) 1 << k;
+        size_t start = unit & ~(block - 1);
+
+        if (start + block > buddy->units)
+            break;
+        if (_mem_buddy_bit(buddy, 0, k, start))
+            return 1;
+        if (_mem_buddy_bit(buddy, 1, k, start))
+            return 0;
+    }
+
+    return 0;
+}
+
+// puts a free block on its list, failing, with nothing changed, if its
+// link can't be committed
+static alloc_status _mem_buddy_push(pool_mgr_pt pool_mgr, unsigned order, size_t unit) {
+    buddy_pt buddy = pool_mgr->buddy;
+    char *mem = pool_mgr->pool.mem + unit * MEM_BUDDY_MIN_BLOCK;
+    buddy_link_pt link = (buddy_link_pt) mem;
+
+    if (_mem_commit(pool_mgr, mem, sizeof(buddy_link_t)) != ALLOC_OK) {
+        return ALLOC_FAIL;
+    }
+
+    link->prev = NULL;
+    link->next = buddy->heads[order];
+    if (link->next != NULL)
+        ((buddy_link_pt) link->next)->prev = mem;
+    buddy->heads[order] = mem;
+    buddy->nonempty |= (uint64_t) 1 << order;
+
+    _mem_buddy_flip(buddy, 0, order, unit);
+
+    return ALLOC_OK;
+}
+
+static void _mem_buddy_unlink(pool_mgr_pt pool_mgr, unsigned order, size_t unit) {
+    buddy_pt buddy = pool_mgr->buddy;
+    buddy_link_pt link = (buddy_link_pt) (pool_mgr->pool.mem + unit * MEM_BUDDY_MIN_BLOCK);
+
+    if (link->prev != NULL)
+        ((buddy_link_pt) link->prev)->next = link->next;
+    else
+        buddy->heads[order] = link->next;
+    if (link->next != NULL)
+        ((buddy_link_pt) link->next)->prev = link->prev;
+    if (buddy->heads[order] == NULL)
+        buddy->nonempty &= ~((uint64_t) 1 << order);
+
+    _mem_buddy_flip(buddy, 0, order, unit);
+}
+
+static void *_mem_buddy_alloc(pool_mgr_pt pool_mgr, size_t size) {
+    buddy_pt buddy = pool_mgr->buddy;
+    unsigned order = 0;
+
+    if (size == 0 || size > pool_mgr->pool.total_size) {
+        return NULL;
+    }
+
+    while ((MEM_BUDDY_MIN_BLOCK << order) < size)
+        order++;
+
+    // the smallest free block that is big enough
+    uint64_t candidates = buddy->nonempty & (~(uint64_t) 0 << order);
+    if (candidates == 0) {
+        return NULL;
+    }
+
+    unsigned k = (unsigned) __builtin_ctzll((unsigned long long) candidates);
+    size_t unit = (size_t) (buddy->heads[k] - pool_mgr->pool.mem) / MEM_BUDDY_MIN_BLOCK;
+
+    // the block has to be usable before anything changes
+    if (_mem_commit(pool_mgr, buddy->heads[k], MEM_BUDDY_MIN_BLOCK << order) != ALLOC_OK) {
+        return NULL;
+    }
+
+    _mem_buddy_unlink(pool_mgr, k, unit);
+
+    // give back the upper halves until the block is the right size; if a
+    // half's link can't be committed, what is left of the block goes back
+    // whole, its link lying in the memory just committed
+    while (k > order) {
+        k--;
+        if (_mem_buddy_push(pool_mgr, k, unit + ((size_t) 1 << k)) != ALLOC_OK) {
+            (void) _mem_buddy_push(pool_mgr, k + 1, unit);
+            return NULL;
+        }
+    }
+
+    // splitting a gap makes two, filling one in makes none
+    int left = unit > 0 && _mem_buddy_is_free(buddy, unit - 1);
+    int right = _mem_buddy_is_free(buddy, unit + ((size_t) 1 << order));
+    if (left && right)
+        pool_mgr->pool.num_gaps++;
+    else if (!left && !right)
+        pool_mgr->pool.num_gaps--;
+
+    _mem_buddy_flip(buddy, 1, order, unit);
+    pool_mgr->pool.num_allocs++;
+    pool_mgr->pool.alloc_size += MEM_BUDDY_MIN_BLOCK << order;
+
+    return pool_mgr->pool.mem + unit * MEM_BUDDY_MIN_BLOCK;
+}
+
+static alloc_status _mem_buddy_free(pool_mgr_pt pool_mgr, void *alloc) {
+    buddy_pt buddy = pool_mgr->buddy;
+    char *mem = alloc;
+    int allocated = 0;
+    unsigned order = MEM_BUDDY_ORDERS;
+    size_t unit = 0;
+
+    if (mem >= pool_mgr->pool.mem && mem < pool_mgr->pool.mem + pool_mgr->pool.total_size
+        && (size_t) (mem - pool_mgr->pool.mem) % MEM_BUDDY_MIN_BLOCK == 0) {
+        unit = (size_t) (mem - pool_mgr->pool.mem) / MEM_BUDDY_MIN_BLOCK;
+        order = _mem_buddy_order(buddy, unit, &allocated);
+    }
+    if (order == MEM_BUDDY_ORDERS || !allocated) {
+        printf("Node to delete not found in memory pool\n");
+        return ALLOC_FAIL;
+    }
+
+    _mem_buddy_flip(buddy, 1, order, unit);
+    pool_mgr->pool.num_allocs--;
+    pool_mgr->pool.alloc_size -= MEM_BUDDY_MIN_BLOCK << order;
+
+    int left = unit > 0 && _mem_buddy_is_free(buddy, unit - 1);
+    int right = _mem_buddy_is_free(buddy, unit + ((size_t) 1 << order));
+    if (!left && !right)
+        pool_mgr->pool.num_gaps++;
+    else if (left && right)
+        pool_mgr->pool.num_gaps--;
+
+    // merge upward while the buddy is a free block of the same order
+    while (order < buddy->max_order) {
+        size_t mate = unit ^ ((size_t) 1 << order);
+
+        if (mate + ((size_t) 1 << order) > buddy->units || !_mem_buddy_bit(buddy, 0, order, mate))
+            break;
+        _mem_buddy_unlink(pool_mgr, order, mate);
+        unit &= mate;
+        order++;
+    }
+
+    // the merged block starts at the freed one or at a free mate, so its
+    // link is in committed memory
+    return _mem_buddy_push(pool_mgr, order, unit);
+}
+
+// resizes within the block: a smaller order hands back the upper halves,
+// and anything bigger has to move
+static void *_mem_buddy_resize(pool_mgr_pt pool_mgr, void *alloc, size_t size, size_t *old_size) {
+    buddy_pt buddy = pool_mgr->buddy;
+    char *mem = alloc;
+    int allocated = 0;
+    unsigned order = MEM_BUDDY_ORDERS, new_order = 0;
+    size_t unit = 0;
+
+    if (mem >= pool_mgr->pool.mem && mem < pool_mgr->pool.mem + pool_mgr->pool.total_size
+        && (size_t) (mem - pool_mgr->pool.mem) % MEM_BUDDY_MIN_BLOCK == 0) {
+        unit = (size_t) (mem - pool_mgr->pool.mem) / MEM_BUDDY_MIN_BLOCK;
+        order = _mem_buddy_order(buddy, unit, &allocated);
+    }
+    if (order == MEM_BUDDY_ORDERS || !allocated) {
+        printf("Node to resize not found in memory pool\n");
+        return NULL;
+    }
+
+    *old_size = MEM_BUDDY_MIN_BLOCK << order;
+    if (size > *old_size) {
+        return NULL;
+    }
+
+    while ((MEM_BUDDY_MIN_BLOCK << new_order) < size)
+        new_order++;
+    if (new_order == order) {
+        return alloc;
+    }
+
+    // the freed tail is a new gap unless the block after it is free; its
+    // buddies are all allocated, so none of the halves merge
+    if (!_mem_buddy_is_free(buddy, unit + ((size_t) 1 << order)))
+        pool_mgr->pool.num_gaps++;
+    pool_mgr->pool.alloc_size -= (MEM_BUDDY_MIN_BLOCK << order) - (MEM_BUDDY_MIN_BLOCK << new_order);
+
+    // the halves lie inside the allocated block, so their links are in
+    // committed memory
+    _mem_buddy_flip(buddy, 1, order, unit);
+    while (order > new_order) {
+        order--;
+        (void) _mem_buddy_push(pool_mgr, order, unit + ((size_t) 1 << order));
+    }
+    _mem_buddy_flip(buddy, 1, new_order, unit);
+
+    return alloc;
+}
+
+// one free block per bit of the pool size, largest first, so that each
+// is aligned to its size
+// note: only fails the first time, in a lazy pool, as it commits the
+// same links every time
+static alloc_status _mem_buddy_reset(pool_mgr_pt pool_mgr) {
+    buddy_pt buddy = pool_mgr->buddy;
+    size_t unit = 0;
+
+    memset(buddy->bitmap, 0, 2 * buddy->words * sizeof(uint64_t));
+    memset(buddy->heads, 0, sizeof(buddy->heads));
+    buddy->nonempty = 0;
+
+    for (unsigned k = buddy->max_order + 1; k-- > 0; ) {
+        if (buddy->units & ((size_t) 1 << k)) {
+            if (_mem_buddy_push(pool_mgr, k, unit) != ALLOC_OK)
+                return ALLOC_FAIL;
+            unit += (size_t) 1 << k;
+        }
+    }
+
+    pool_mgr->pool.num_allocs = 0;
+    pool_mgr->pool.alloc_size = 0;
+    pool_mgr->pool.num_gaps = 1;
+
+    return ALLOC_OK;
+}
@@ -7,7 +7,18 @@
 
 /* type declarations */
 
-typedef enum _alloc_policy { FIRST_FIT, BEST_FIT } alloc_policy;
+// note: SLAB pools are opened with mem_slab_open()
+typedef enum _alloc_policy { FIRST_FIT, BEST_FIT, TLSF, NEXT_FIT, ARENA, SLAB, BUDDY } alloc_policy;
+
+// how mem_pool_open_flags() gets the pool memory, or-ed together
+typedef enum _pool_flag {
+    POOL_DEFAULT    = 0,        // malloc, as mem_pool_open() does
+    POOL_MMAP       = 1 << 0,   // an anonymous mapping
+    POOL_HUGE_PAGES = 1 << 1,   // mapped with huge pages where available
+    POOL_LAZY_COMMIT = 1 << 2,  // mapped PROT_NONE, pages made usable as allocations reach them
+    POOL_PREFAULT   = 1 << 3,   // mapped, and every page faulted in while opening
+    POOL_LOCK       = 1 << 4    // faulted in and mlock()-ed, so it is never paged out, or not opened
+} pool_flag;
 
 typedef struct _pool {
     char *mem;
@@ -16,8 +27,28 @@ typedef struct _pool {
     size_t alloc_size;
     unsigned num_allocs;
     unsigned num_gaps;
+    unsigned long cache_hits;     // thread cache counters, see mem_pool_cache_enable()
+    unsigned long cache_misses;
+    unsigned long cache_flushes;
+    unsigned flags;               // the POOL_* flags the pool memory actually has
+    size_t trimmed_size;          // bytes of gaps given back by mem_pool_trim(), not reused yet
+    size_t committed_size;        // bytes of pool memory usable so far (see POOL_LAZY_COMMIT)
+    unsigned long prefault_ns;    // time opening spent faulting in and locking (see POOL_PREFAULT)
 } pool_t, *pool_pt;
 
+// a pool split into independent shards, one per CPU by default
+typedef struct _sharded_pool {
+    size_t total_size;
+    unsigned num_shards;
+    pool_pt *shards;
+} sharded_pool_t, *sharded_pool_pt;
+
+// an ARENA pool's top, to roll back to with mem_pool_release_to_mark()
+typedef struct _pool_mark {
+    size_t offset;
+    unsigned num_allocs;
+} pool_mark_t;
+
 typedef struct _pool_segment {
     size_t size;
     unsigned long allocated; // 1-allocation, 0-gap (note: 8 bytes)
@@ -41,17 +72,70 @@ mem_free();
 pool_pt
 mem_pool_open(size_t size, alloc_policy policy);
 
+pool_pt
+mem_pool_open_flags(size_t size, alloc_policy policy, unsigned flags);
+
+pool_pt
+mem_slab_open(size_t object_size, unsigned count);
+
 alloc_status
 mem_pool_close(pool_pt pool);
 
 void *
 mem_new_alloc(pool_pt pool, size_t size);
 
+void *
+mem_new_alloc_aligned(pool_pt pool, size_t size, size_t alignment);
+
 alloc_status
 mem_del_alloc(pool_pt pool, void *alloc);
 
+void *
+mem_realloc(pool_pt pool, void *alloc, size_t new_size);
+
+// note: O(1) in the number of allocations, but clears the allocation
+// index over its capacity and, for cached pools, a byte per 16 of the pool
+alloc_status
+mem_pool_reset(pool_pt pool);
+
+alloc_status
+mem_pool_trim(pool_pt pool);
+
+pool_mark_t
+mem_pool_mark(pool_pt pool);
+
+alloc_status
+mem_pool_release_to_mark(pool_pt pool, pool_mark_t mark);
+
+alloc_status
+mem_new_alloc_batch(pool_pt pool, const size_t sizes[], unsigned n, void *out[]);
+
+alloc_status
+mem_del_alloc_batch(pool_pt pool, void *allocs[], unsigned n);
+
 void
 mem_inspect_pool(pool_pt pool, pool_segment_pt *segments, unsigned *num_segments);
 
+size_t
+mem_inspect_metadata(pool_pt pool);
+
+alloc_status
+mem_pool_cache_enable(pool_pt pool);
+
+alloc_status
+mem_pool_cache_flush(pool_pt pool);
+
+sharded_pool_pt
+mem_sharded_pool_open(size_t size, alloc_policy policy, unsigned num_shards);
+
+alloc_status
+mem_sharded_pool_close(sharded_pool_pt sharded);
+
+void *
+mem_sharded_new_alloc(sharded_pool_pt sharded, size_t size);
+
+alloc_status
+mem_sharded_del_alloc(sharded_pool_pt sharded, void *alloc);
+
 
 #endif //C_MEM_POOL_H
@@ -4,6 +4,15 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#ifdef MEM_POOL_THREAD_SAFE
+#include <pthread.h>
+#endif
 
 #include <stdarg.h>
 #include <stddef.h>
@@ -2314,7 +2323,243 @@ static void test_pool_scenario19(void **state) {
 }
 
 /*******************************************/
-/***        5. STRESS TESTING            ***/
+/***          5. TLSF SCENARIOS          ***/
+/*******************************************/
+
+static int pool_tlsf_setup(void **state) {
+    alloc_status status;
+    const alloc_policy POOL_POLICY = TLSF;
+    pool_pt pool = NULL;
+
+    status = mem_init();
+    assert_int_equal(status, ALLOC_OK);
+
+    INFO("Allocating pool of %lu bytes with policy %s\n",
+         (long) POOL_SIZE, "TLSF");
+    pool = mem_pool_open(POOL_SIZE, POOL_POLICY);
+    assert_non_null(pool);
+
+    *state = pool;
+
+    return 0;
+}
+
+static int pool_tlsf_teardown(void **state) {
+    pool_pt pool = *state;
+    alloc_status status;
+
+    INFO("Closing pool\n");
+    status = mem_pool_close(pool);
+    assert_int_equal(status, ALLOC_OK);
+
+    status = mem_free();
+    assert_int_equal(status, ALLOC_OK);
+
+    return 0;
+}
+
+static void test_pool_scenario20(void **state) {
+    pool_pt pool = *state;
+
+    /*
+     * Scenario 20:
+     *
+     * 1. Pool starts out as a single gap.
+     * 2. Allocate 10 x 100.
+     * 3. Deallocate (2, 1, 3), (6, 5), 8
+     * 4. Allocate 100. The 100 gap is in the class the request rounds up to.
+     * 5. Allocate 250. It goes into the 300 gap, the first class above 256.
+     * 6. Allocate the rest of the pool, which is an exact fit.
+     * 7. Clean up.
+     */
+
+    pool_segment_t exp0[1] =
+            {
+                    {pool->total_size, 0}
+            };
+    check_pool(pool, exp0);
+
+
+    const unsigned NUM_ALLOCS = 10;
+
+    void * *allocs = (void * *) calloc(NUM_ALLOCS, sizeof(void *));
+    assert_non_null(allocs);
+
+    for (int i=0; i<NUM_ALLOCS; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+    }
+    assert_int_equal(mem_del_alloc(pool, allocs[2]), ALLOC_OK); allocs[2]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK); allocs[1]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[3]), ALLOC_OK); allocs[3]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[6]), ALLOC_OK); allocs[6]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[5]), ALLOC_OK); allocs[5]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[8]), ALLOC_OK); allocs[8]=0;
+
+    pool_segment_t exp1[8] =
+            {
+                    {100, 1},
+                    {300, 0},
+                    {100, 1},
+                    {200, 0},
+                    {100, 1},
+                    {100, 0},
+                    {100, 1},
+                    {pool->total_size - 1000, 0},
+            };
+    check_pool(pool, exp1);
+
+
+    void * alloc0 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc0);
+
+    void * alloc1 = mem_new_alloc(pool, 250);
+    assert_non_null(alloc1);
+
+    pool_segment_t exp2[9] =
+            {
+                    {100, 1},
+                    {250, 1},
+                    {50, 0},
+                    {100, 1},
+                    {200, 0},
+                    {100, 1},
+                    {100, 1},
+                    {100, 1},
+                    {pool->total_size - 1000, 0},
+            };
+    check_pool(pool, exp2);
+
+
+    void * alloc2 = mem_new_alloc(pool, pool->total_size - 1000);
+    assert_non_null(alloc2);
+    assert_int_equal(pool->num_gaps, 2);
+
+
+    // clean up
+    for (int i=0; i<NUM_ALLOCS; ++i) {
+        if (allocs[i])
+            assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    free(allocs);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+
+
+    check_pool(pool, exp0);
+}
+
+/*******************************************/
+/***        6. NEXT_FIT SCENARIOS        ***/
+/*******************************************/
+
+static int pool_nf_setup(void **state) {
+    alloc_status status;
+    const alloc_policy POOL_POLICY = NEXT_FIT;
+    pool_pt pool = NULL;
+
+    status = mem_init();
+    assert_int_equal(status, ALLOC_OK);
+
+    INFO("Allocating pool of %lu bytes with policy %s\n",
+         (long) POOL_SIZE, "NEXT_FIT");
+    pool = mem_pool_open(POOL_SIZE, POOL_POLICY);
+    assert_non_null(pool);
+
+    *state = pool;
+
+    return 0;
+}
+
+static int pool_nf_teardown(void **state) {
+    pool_pt pool = *state;
+    alloc_status status;
+
+    INFO("Closing pool\n");
+    status = mem_pool_close(pool);
+    assert_int_equal(status, ALLOC_OK);
+
+    status = mem_free();
+    assert_int_equal(status, ALLOC_OK);
+
+    return 0;
+}
+
+static void test_pool_scenario21(void **state) {
+    pool_pt pool = *state;
+
+    /*
+     * Scenario 21:
+     *
+     * 1. Pool starts out as a single gap.
+     * 2. Allocate 100, 200, 300.
+     * 3. Deallocate the 100. There is a gap at the top.
+     * 4. Allocate 50. Unlike FIRST_FIT, it goes after the 300.
+     * 5. Allocate the rest of the pool.
+     * 6. Allocate 100. The search wraps around to the gap at the top.
+     * 7. Clean up.
+     */
+
+    pool_segment_t exp0[1] =
+            {
+                    {pool->total_size, 0}
+            };
+    check_pool(pool, exp0);
+
+
+    void * alloc0 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc0);
+    void * alloc1 = mem_new_alloc(pool, 200);
+    assert_non_null(alloc1);
+    void * alloc2 = mem_new_alloc(pool, 300);
+    assert_non_null(alloc2);
+
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+
+
+    void * alloc3 = mem_new_alloc(pool, 50);
+    assert_non_null(alloc3);
+
+    pool_segment_t exp1[5] =
+            {
+                    {100, 0},
+                    {200, 1},
+                    {300, 1},
+                    {50, 1},
+                    {pool->total_size - 650, 0}
+            };
+    check_pool(pool, exp1);
+
+
+    void * alloc4 = mem_new_alloc(pool, pool->total_size - 650);
+    assert_non_null(alloc4);
+    void * alloc5 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc5);
+
+    pool_segment_t exp2[5] =
+            {
+                    {100, 1},
+                    {200, 1},
+                    {300, 1},
+                    {50, 1},
+                    {pool->total_size - 650, 1}
+            };
+    check_pool(pool, exp2);
+
+
+    // clean up
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc3), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc4), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc5), ALLOC_OK);
+
+    check_pool(pool, exp0);
+}
+
+/*******************************************/
+/***        7. STRESS TESTING            ***/
 /*******************************************/
 
 void test_pool_stresstest0(void **state) {
@@ -2393,46 +2638,1714 @@ void test_pool_stresstest0(void **state) {
 
 
 /*******************************************/
-/***         6. DRIVER ROUTINE           ***/
+/***          8. THREAD SAFETY           ***/
 /*******************************************/
 
-int run_test_suite() {
-    const struct CMUnitTest tests[] = {
-            // General tests
-            cmocka_unit_test(test_pool_store_smoketest),
-            cmocka_unit_test(test_pool_smoketest),
+#ifdef MEM_POOL_THREAD_SAFE
+
+#define NUM_TEST_THREADS 4
+
+typedef struct _thread_test {
+    pool_pt shared;     // pool used by all threads
+    sharded_pool_pt sharded; // or sharded pool, for sharded_worker()
+    unsigned cached;    // flush the thread's cache of the shared pool on exit
+    unsigned seed;
+    unsigned errors;    // cmocka asserts can't be used off the main thread
+} thread_test_t;
+
+static void *thread_test_worker(void *arg) {
+    thread_test_t *test = arg;
+    const unsigned num_rounds = 200;
+    const unsigned num_allocations = 50;
+    void *own[num_allocations];
+    void *shared[num_allocations];
+
+    for (unsigned r = 0; r < num_rounds; ++r) {
+        // a private pool, opened and closed while the other threads do the same
+        pool_pt pool = mem_pool_open(num_allocations * 64, r % 2 ? FIRST_FIT : BEST_FIT);
+        if (pool == NULL) {
+            test->errors++;
+            continue;
+        }
 
-            cmocka_unit_test(test_pool_nonempty),
+        for (unsigned aix = 0; aix < num_allocations; ++aix) {
+            size_t size = 1 + (test->seed * 31 + aix * 7) % 64;
+            own[aix] = mem_new_alloc(pool, size);
+            shared[aix] = mem_new_alloc(test->shared, size);
+            if (own[aix] == NULL || shared[aix] == NULL) {
+                test->errors++;
+                continue;
+            }
+            // tag both; another thread's allocation overlapping ours would show up below
+            memset(own[aix], (int) test->seed, size);
+            memset(shared[aix], (int) test->seed, size);
+        }
 
-            cmocka_unit_test_setup_teardown(test_pool_ff_metadata, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_bf_metadata, pool_bf_setup, pool_bf_teardown),
+        for (unsigned aix = 0; aix < num_allocations; ++aix) {
+            if (own[aix] == NULL || shared[aix] == NULL)
+                continue;
+            if (*(unsigned char *) shared[aix] != (unsigned char) test->seed)
+                test->errors++;
+            if (mem_del_alloc(pool, own[aix]) != ALLOC_OK)
+                test->errors++;
+            if (mem_del_alloc(test->shared, shared[aix]) != ALLOC_OK)
+                test->errors++;
+        }
 
-            // First-fit tests
-            cmocka_unit_test_setup_teardown(test_pool_scenario00, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario01, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario02, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario03, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario04, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario05, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario06, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario07, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario08, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario09, pool_ff_setup, pool_ff_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario10, pool_ff_setup, pool_ff_teardown),
+        if (mem_pool_close(pool) != ALLOC_OK)
+            test->errors++;
+    }
 
-            // Best-fit tests
-            cmocka_unit_test_setup_teardown(test_pool_scenario11, pool_bf_setup, pool_bf_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario12, pool_bf_setup, pool_bf_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario13, pool_bf_setup, pool_bf_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario14, pool_bf_setup, pool_bf_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario15, pool_bf_setup, pool_bf_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario16, pool_bf_setup, pool_bf_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario17, pool_bf_setup, pool_bf_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario18, pool_bf_setup, pool_bf_teardown),
-            cmocka_unit_test_setup_teardown(test_pool_scenario19, pool_bf_setup, pool_bf_teardown),
+    if (test->cached && mem_pool_cache_flush(test->shared) != ALLOC_OK)
+        test->errors++;
 
-            // Stress tests
-            cmocka_unit_test(test_pool_stresstest0),
+    return NULL;
+}
+
+void test_pool_threads0(void **state) {
+    (void) state; /* unused */
+
+    pthread_t threads[NUM_TEST_THREADS];
+    thread_test_t tests[NUM_TEST_THREADS];
+
+    /*
+     * Concurrent use of the pool store and of a shared pool:
+     *
+     * 1. Each thread repeatedly opens, fills, empties and closes its own pool.
+     * 2. Every allocation is mirrored in a pool shared by all threads.
+     * 3. At the end the shared pool is back to a single gap.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt shared = mem_pool_open(POOL_SIZE, BEST_FIT);
+    assert_non_null(shared);
+
+    for (unsigned t = 0; t < NUM_TEST_THREADS; ++t) {
+        tests[t].shared = shared;
+        tests[t].cached = 0;
+        tests[t].seed = t + 1;
+        tests[t].errors = 0;
+        assert_int_equal(pthread_create(&threads[t], NULL, thread_test_worker, &tests[t]), 0);
+    }
+    for (unsigned t = 0; t < NUM_TEST_THREADS; ++t) {
+        assert_int_equal(pthread_join(threads[t], NULL), 0);
+        assert_int_equal(tests[t].errors, 0);
+    }
+
+    assert_int_equal(shared->num_allocs, 0);
+    assert_int_equal(shared->num_gaps, 1);
+    assert_int_equal(shared->alloc_size, 0);
+
+    assert_int_equal(mem_pool_close(shared), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+typedef struct _remote_free_test {
+    pool_pt pool;
+    void **allocs;
+    unsigned num_allocs;
+    size_t size;
+    unsigned errors;
+} remote_free_test_t;
+
+static void *remote_free_worker(void *arg) {
+    remote_free_test_t *test = arg;
+
+    for (unsigned aix = 0; aix < test->num_allocs; ++aix) {
+        if (mem_del_alloc(test->pool, test->allocs[aix]) != ALLOC_OK)
+            test->errors++;
+    }
+
+    // bad handles fail here, not later in whichever thread applies them
+    if (mem_del_alloc(test->pool, test->allocs[0]) != ALLOC_FAIL)
+        test->errors++;
+    if (mem_del_alloc(test->pool, test->pool->mem + 3) != ALLOC_FAIL)
+        test->errors++;
+
+    // the whole pool is one gap again, for this thread too
+    void *alloc = mem_new_alloc(test->pool, test->num_allocs * test->size);
+    if (alloc == NULL || mem_del_alloc(test->pool, alloc) != ALLOC_OK)
+        test->errors++;
+
+    return NULL;
+}
+
+void test_pool_threads2(void **state) {
+    (void) state; /* unused */
+
+    const unsigned num_allocations = 100;
+    const size_t size = 100;
+    void *allocs[num_allocations];
+    pthread_t thread;
+    remote_free_test_t test = { NULL, allocs, num_allocations, size, 0 };
+
+    /*
+     * Frees from a thread other than the one that opened the pool:
+     *
+     * 1. The opener fills the pool, another thread frees everything.
+     * 2. That thread's double free and bad handle fail right away.
+     * 3. The frees are applied as they are made, so that thread can
+     *    allocate the whole pool again, and the opener finds it empty.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    test.pool = mem_pool_open(num_allocations * size, FIRST_FIT);
+    assert_non_null(test.pool);
+
+    for (unsigned aix = 0; aix < num_allocations; ++aix) {
+        allocs[aix] = mem_new_alloc(test.pool, size);
+        assert_non_null(allocs[aix]);
+    }
+    assert_null(mem_new_alloc(test.pool, size));
+
+    assert_int_equal(pthread_create(&thread, NULL, remote_free_worker, &test), 0);
+    assert_int_equal(pthread_join(thread, NULL), 0);
+    assert_int_equal(test.errors, 0);
+
+    assert_int_equal(test.pool->num_allocs, 0);
+    assert_int_equal(test.pool->num_gaps, 1);
+
+    assert_int_equal(mem_pool_close(test.pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void *sharded_worker(void *arg) {
+    thread_test_t *test = arg;
+    sharded_pool_pt sharded = test->sharded;
+    const unsigned num_rounds = 200;
+    const unsigned num_allocations = 50;
+    void *allocs[num_allocations];
+
+    for (unsigned r = 0; r < num_rounds; ++r) {
+        for (unsigned aix = 0; aix < num_allocations; ++aix) {
+            size_t size = 1 + (test->seed * 31 + aix * 7) % 64;
+            allocs[aix] = mem_sharded_new_alloc(sharded, size);
+            if (allocs[aix] == NULL) {
+                test->errors++;
+                continue;
+            }
+            memset(allocs[aix], (int) test->seed, size);
+        }
+        for (unsigned aix = 0; aix < num_allocations; ++aix) {
+            if (allocs[aix] == NULL)
+                continue;
+            if (*(unsigned char *) allocs[aix] != (unsigned char) test->seed)
+                test->errors++;
+            if (mem_sharded_del_alloc(sharded, allocs[aix]) != ALLOC_OK)
+                test->errors++;
+        }
+    }
+
+    return NULL;
+}
+
+void test_pool_threads3(void **state) {
+    (void) state; /* unused */
+
+    pthread_t threads[NUM_TEST_THREADS];
+    thread_test_t tests[NUM_TEST_THREADS];
+
+    /*
+     * Threads sharing a sharded pool, one shard per CPU. Their frees
+     * lock the shard rather than wait for the thread that opened it.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    sharded_pool_pt sharded = mem_sharded_pool_open(POOL_SIZE, BEST_FIT, 0);
+    assert_non_null(sharded);
+
+    for (unsigned t = 0; t < NUM_TEST_THREADS; ++t) {
+        tests[t].shared = NULL;
+        tests[t].sharded = sharded;
+        tests[t].cached = 0;
+        tests[t].seed = t + 1;
+        tests[t].errors = 0;
+        assert_int_equal(pthread_create(&threads[t], NULL, sharded_worker, &tests[t]), 0);
+    }
+    for (unsigned t = 0; t < NUM_TEST_THREADS; ++t) {
+        assert_int_equal(pthread_join(threads[t], NULL), 0);
+        assert_int_equal(tests[t].errors, 0);
+    }
+
+    // the workers' frees are applied as they are made
+    for (unsigned six = 0; six < sharded->num_shards; ++six) {
+        assert_int_equal(sharded->shards[six]->num_allocs, 0);
+        assert_int_equal(sharded->shards[six]->num_gaps, 1);
+    }
+
+    assert_int_equal(mem_sharded_pool_close(sharded), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+#endif
+
+
+/*******************************************/
+/***          9. THREAD CACHES           ***/
+/*******************************************/
+
+void test_pool_cache0(void **state) {
+    (void) state; /* unused */
+
+    const unsigned num_rounds = 100;
+    const unsigned num_allocations = 20;
+    void *allocs[num_allocations];
+    pool_segment_pt segs = NULL;
+    unsigned num_segs = 0;
+
+    /*
+     * Single-thread cache behavior:
+     *
+     * 1. Sizes are rounded up to whole granules.
+     * 2. Repeated alloc/free of the same sizes is served from the cache.
+     * 3. A flush gives every segment back, leaving one gap.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+
+    void *alloc = mem_new_alloc(pool, 10);
+    assert_non_null(alloc);
+    assert_int_equal(mem_pool_cache_enable(pool), ALLOC_NOT_FREED);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+
+    assert_int_equal(mem_pool_cache_enable(pool), ALLOC_OK);
+    assert_int_equal(mem_pool_cache_enable(pool), ALLOC_CALLED_AGAIN);
+
+    for (unsigned r = 0; r < num_rounds; ++r) {
+        for (unsigned aix = 0; aix < num_allocations; ++aix) {
+            allocs[aix] = mem_new_alloc(pool, 1 + aix * 5);
+            assert_non_null(allocs[aix]);
+            assert_int_equal(((char *) allocs[aix] - pool->mem) % 16, 0);
+        }
+        for (unsigned aix = 0; aix < num_allocations; ++aix) {
+            assert_int_equal(mem_del_alloc(pool, allocs[aix]), ALLOC_OK);
+        }
+    }
+
+    // large sizes bypass the cache
+    alloc = mem_new_alloc(pool, 1000);
+    assert_non_null(alloc);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+
+    // cached segments still count as allocations until flushed
+    assert_int_not_equal(pool->num_allocs, 0);
+    assert_int_equal(mem_pool_cache_flush(pool), ALLOC_OK);
+    assert_int_equal(pool->num_allocs, 0);
+    assert_int_equal(pool->alloc_size, 0);
+
+    mem_inspect_pool(pool, &segs, &num_segs);
+    assert_int_equal(num_segs, 1);
+    free(segs);
+
+    INFO("%lu cache hits, %lu misses, %lu flushes\n",
+         pool->cache_hits, pool->cache_misses, pool->cache_flushes);
+    assert_true(pool->cache_hits > pool->cache_misses);
+    assert_true(pool->cache_hits + pool->cache_misses == num_rounds * num_allocations);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+void test_pool_cache1(void **state) {
+    (void) state; /* unused */
+
+    const unsigned num_allocations = 16;
+    void *allocs[num_allocations];
+
+    /*
+     * Thread caches don't outlive their pool:
+     *
+     * 1. Fill the cache of a pool, then close it.
+     * 2. A pool opened next (likely at the same address) starts with no
+     *    allocations, and its first cached allocation is a miss.
+     * 3. It closes cleanly.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    assert_int_equal(mem_pool_cache_enable(pool), ALLOC_OK);
+    for (unsigned aix = 0; aix < num_allocations; ++aix) {
+        allocs[aix] = mem_new_alloc(pool, 16);
+        assert_non_null(allocs[aix]);
+    }
+    for (unsigned aix = 0; aix < num_allocations; ++aix) {
+        assert_int_equal(mem_del_alloc(pool, allocs[aix]), ALLOC_OK);
+    }
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    assert_int_equal(pool->num_allocs, 0);
+    assert_int_equal(mem_pool_cache_enable(pool), ALLOC_OK);
+
+    void *alloc = mem_new_alloc(pool, 16);
+    assert_non_null(alloc);
+    assert_int_equal(pool->cache_hits, 0);
+    assert_int_equal(pool->cache_misses, 1);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+void test_pool_cache2(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Misuse of a cached pool:
+     *
+     * 1. Freeing a cached segment twice fails, and the next two
+     *    allocations get different segments.
+     * 2. Closing the pool with an allocation fails and leaves the cache
+     *    as it was, so the next allocation comes from the same magazine.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    assert_int_equal(mem_pool_cache_enable(pool), ALLOC_OK);
+
+    void *alloc = mem_new_alloc(pool, 16);
+    assert_non_null(alloc);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_FAIL);
+
+    void *first = mem_new_alloc(pool, 16);
+    void *second = mem_new_alloc(pool, 16);
+    assert_non_null(first);
+    assert_non_null(second);
+    assert_true(first != second);
+    assert_int_equal(mem_del_alloc(pool, second), ALLOC_OK);
+
+    // the segment just freed is still on top of its magazine
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+    alloc = mem_new_alloc(pool, 16);
+    assert_true(alloc == second);
+
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, first), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+#ifdef MEM_POOL_THREAD_SAFE
+
+void test_pool_threads1(void **state) {
+    (void) state; /* unused */
+
+    pthread_t threads[NUM_TEST_THREADS];
+    thread_test_t tests[NUM_TEST_THREADS];
+
+    /*
+     * As test_pool_threads0, with thread caches on the shared pool.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt shared = mem_pool_open(POOL_SIZE, BEST_FIT);
+    assert_non_null(shared);
+    assert_int_equal(mem_pool_cache_enable(shared), ALLOC_OK);
+
+    for (unsigned t = 0; t < NUM_TEST_THREADS; ++t) {
+        tests[t].shared = shared;
+        tests[t].cached = 1;
+        tests[t].seed = t + 1;
+        tests[t].errors = 0;
+        assert_int_equal(pthread_create(&threads[t], NULL, thread_test_worker, &tests[t]), 0);
+    }
+    for (unsigned t = 0; t < NUM_TEST_THREADS; ++t) {
+        assert_int_equal(pthread_join(threads[t], NULL), 0);
+        assert_int_equal(tests[t].errors, 0);
+    }
+
+    INFO("%lu cache hits, %lu misses, %lu flushes\n",
+         shared->cache_hits, shared->cache_misses, shared->cache_flushes);
+    assert_true(shared->cache_hits > 0);
+
+    assert_int_equal(shared->num_allocs, 0);
+    assert_int_equal(shared->num_gaps, 1);
+
+    assert_int_equal(mem_pool_close(shared), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+#endif
+
+
+/*******************************************/
+/***          10. SHARDED POOLS          ***/
+/*******************************************/
+
+void test_pool_sharded0(void **state) {
+    (void) state; /* unused */
+
+    const unsigned num_shards = 4;
+    const size_t shard_size = 1000;
+    const size_t alloc_size = 100;
+    const unsigned num_allocations = num_shards * shard_size / alloc_size;
+    void *allocs[num_allocations];
+
+    /*
+     * Shard selection, stealing and free routing:
+     *
+     * 1. Fill all shards from one thread, which has to steal from the others.
+     * 2. The next allocation fails, every shard is full.
+     * 3. Free everything, each free routed to its own shard.
+     * 4. With one shard busy, closing fails and closes no shard, so the
+     *    pool can still free and allocate.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    sharded_pool_pt sharded = mem_sharded_pool_open(num_shards * shard_size, FIRST_FIT, num_shards);
+    assert_non_null(sharded);
+    assert_int_equal(sharded->num_shards, num_shards);
+
+    for (unsigned aix = 0; aix < num_allocations; ++aix) {
+        allocs[aix] = mem_sharded_new_alloc(sharded, alloc_size);
+        assert_non_null(allocs[aix]);
+    }
+    assert_null(mem_sharded_new_alloc(sharded, alloc_size));
+
+    for (unsigned six = 0; six < num_shards; ++six) {
+        assert_int_equal(sharded->shards[six]->num_allocs, shard_size / alloc_size);
+        assert_int_equal(sharded->shards[six]->num_gaps, 0);
+    }
+
+    // a pool that is still in use can't be closed
+    assert_int_not_equal(mem_sharded_pool_close(sharded), ALLOC_OK);
+
+    int not_ours = 0;
+    assert_int_equal(mem_sharded_del_alloc(sharded, &not_ours), ALLOC_FAIL);
+
+    for (unsigned aix = 0; aix < num_allocations; ++aix) {
+        assert_int_equal(mem_sharded_del_alloc(sharded, allocs[aix]), ALLOC_OK);
+    }
+
+    assert_int_equal(mem_sharded_pool_close(sharded), ALLOC_OK);
+
+    // with just one shard busy, a failed close leaves every shard open
+    sharded = mem_sharded_pool_open(num_shards * shard_size, FIRST_FIT, num_shards);
+    assert_non_null(sharded);
+    void *alloc = mem_sharded_new_alloc(sharded, alloc_size);
+    assert_non_null(alloc);
+    assert_int_not_equal(mem_sharded_pool_close(sharded), ALLOC_OK);
+    for (unsigned six = 0; six < num_shards; ++six) {
+        assert_non_null(sharded->shards[six]);
+    }
+
+    assert_int_equal(mem_sharded_del_alloc(sharded, alloc), ALLOC_OK);
+    alloc = mem_sharded_new_alloc(sharded, alloc_size);
+    assert_non_null(alloc);
+    assert_int_equal(mem_sharded_del_alloc(sharded, alloc), ALLOC_OK);
+
+    assert_int_equal(mem_sharded_pool_close(sharded), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+/*******************************************/
+/***          11. BATCH API              ***/
+/*******************************************/
+
+void test_pool_batch0(void **state) {
+    (void) state; /* unused */
+
+    const size_t sizes[] = { 100, 200, 300, 400, 500 };
+    const unsigned n = sizeof(sizes) / sizeof(sizes[0]);
+    void *allocs[n];
+    void *frees[3];
+    pool_segment_pt segs = NULL;
+    unsigned num_segs = 0;
+
+    /*
+     * Batch allocation and deallocation:
+     *
+     * 1. Allocate five segments in one batch, laid out in order.
+     * 2. Free three adjacent ones and the last in one batch, which leaves
+     *    one merged gap and one gap merged with the top of the pool.
+     * 3. A batch that doesn't fit allocates nothing.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open(2000, FIRST_FIT);
+    assert_non_null(pool);
+
+    assert_int_equal(mem_new_alloc_batch(pool, sizes, n, allocs), ALLOC_OK);
+    assert_int_equal(pool->num_allocs, n);
+    assert_int_equal(pool->alloc_size, 1500);
+    for (unsigned i = 1; i < n; ++i) {
+        assert_true((char *) allocs[i] == (char *) allocs[i - 1] + sizes[i - 1]);
+    }
+
+    // out of order, on purpose
+    frees[0] = allocs[2];
+    frees[1] = allocs[4];
+    frees[2] = allocs[1];
+    assert_int_equal(mem_del_alloc_batch(pool, frees, 3), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[3]), ALLOC_OK);
+
+    mem_inspect_pool(pool, &segs, &num_segs);
+    assert_int_equal(num_segs, 2);
+    assert_int_equal(segs[0].size, 100);
+    assert_int_equal(segs[0].allocated, 1);
+    assert_int_equal(segs[1].size, 1900);
+    assert_int_equal(segs[1].allocated, 0);
+    free(segs);
+
+    // the last of these doesn't fit, so none of them stay allocated
+    const size_t too_big[] = { 500, 500, 1000 };
+    assert_int_equal(mem_new_alloc_batch(pool, too_big, 3, allocs + 1), ALLOC_FAIL);
+    assert_int_equal(pool->num_allocs, 1);
+    assert_int_equal(pool->num_gaps, 1);
+
+    // a bad handle fails the batch, but the good ones are still freed
+    frees[0] = allocs[0];
+    frees[1] = allocs[0];
+    assert_int_equal(mem_del_alloc_batch(pool, frees, 2), ALLOC_FAIL);
+    assert_int_equal(pool->num_allocs, 0);
+    assert_int_equal(pool->num_gaps, 1);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+/*******************************************/
+/***          12. POOL RESET             ***/
+/*******************************************/
+
+void test_pool_reset0(void **state) {
+    (void) state; /* unused */
+
+    const alloc_policy policies[] = { FIRST_FIT, BEST_FIT, TLSF, NEXT_FIT };
+    const unsigned num_allocations = 500;
+    pool_segment_pt segs = NULL;
+    unsigned num_segs = 0;
+
+    /*
+     * Resetting a pool with allocations, for each policy:
+     *
+     * 1. Fill the pool with allocations and holes.
+     * 2. Reset it, which leaves one gap the size of the pool.
+     * 3. The pool allocates from the top again and can be closed.
+     * 4. A cached pool drops its thread caches, and the next allocation
+     *    refills a fresh one.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    for (unsigned p = 0; p < sizeof(policies) / sizeof(policies[0]); ++p) {
+        pool_pt pool = mem_pool_open(POOL_SIZE, policies[p]);
+        assert_non_null(pool);
+
+        for (unsigned round = 0; round < 2; ++round) {
+            void *allocs[num_allocations];
+            for (unsigned aix = 0; aix < num_allocations; ++aix) {
+                allocs[aix] = mem_new_alloc(pool, 1 + aix % 97);
+                assert_non_null(allocs[aix]);
+            }
+            for (unsigned aix = 0; aix < num_allocations; aix += 3) {
+                assert_int_equal(mem_del_alloc(pool, allocs[aix]), ALLOC_OK);
+            }
+            assert_int_not_equal(pool->num_gaps, 1);
+
+            assert_int_equal(mem_pool_reset(pool), ALLOC_OK);
+
+            assert_int_equal(pool->num_allocs, 0);
+            assert_int_equal(pool->num_gaps, 1);
+            assert_int_equal(pool->alloc_size, 0);
+            mem_inspect_pool(pool, &segs, &num_segs);
+            assert_int_equal(num_segs, 1);
+            assert_int_equal(segs[0].size, POOL_SIZE);
+            assert_int_equal(segs[0].allocated, 0);
+            free(segs);
+
+            // handles from before the reset are gone
+            assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_FAIL);
+        }
+
+        void *alloc = mem_new_alloc(pool, 100);
+        assert_true(alloc == pool->mem);
+        assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+
+        assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    }
+
+    // a cached pool starts new thread caches after the reset
+    pool_pt pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    assert_int_equal(mem_pool_cache_enable(pool), ALLOC_OK);
+    void *allocs[num_allocations];
+    for (unsigned aix = 0; aix < num_allocations; ++aix) {
+        allocs[aix] = mem_new_alloc(pool, 16);
+        assert_non_null(allocs[aix]);
+    }
+    for (unsigned aix = 0; aix < num_allocations; aix += 2) {
+        assert_int_equal(mem_del_alloc(pool, allocs[aix]), ALLOC_OK);
+    }
+    assert_int_equal(mem_pool_reset(pool), ALLOC_OK);
+    assert_int_equal(pool->num_allocs, 0);
+
+    unsigned long misses = pool->cache_misses;
+    void *alloc = mem_new_alloc(pool, 16);
+    assert_non_null(alloc);
+    assert_int_equal(pool->cache_misses, misses + 1);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    assert_int_equal(mem_pool_cache_flush(pool), ALLOC_OK);
+    assert_int_equal(pool->num_allocs, 0);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+/*******************************************/
+/***          13. ARENA POOLS            ***/
+/*******************************************/
+
+void test_pool_arena0(void **state) {
+    (void) state; /* unused */
+
+    pool_segment_pt segs = NULL;
+    unsigned num_segs = 0;
+
+    /*
+     * Bump allocation with mark/release:
+     *
+     * 1. Allocations are laid out back to back, shown as one segment.
+     * 2. Releasing to a mark drops everything allocated after it.
+     * 3. Freeing every allocation empties the arena.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open(1000, ARENA);
+    assert_non_null(pool);
+
+    void *a = mem_new_alloc(pool, 100);
+    void *b = mem_new_alloc(pool, 200);
+    assert_true(a == pool->mem);
+    assert_true(b == pool->mem + 100);
+    assert_int_equal(pool->alloc_size, 300);
+
+    pool_mark_t mark = mem_pool_mark(pool);
+    assert_non_null(mem_new_alloc(pool, 300));
+    assert_non_null(mem_new_alloc(pool, 400));
+    assert_null(mem_new_alloc(pool, 1));
+    assert_int_equal(pool->num_allocs, 4);
+    assert_int_equal(pool->num_gaps, 0);
+
+    mem_inspect_pool(pool, &segs, &num_segs);
+    assert_int_equal(num_segs, 1);
+    assert_int_equal(segs[0].size, 1000);
+    assert_int_equal(segs[0].allocated, 1);
+    free(segs);
+
+    assert_int_equal(mem_pool_release_to_mark(pool, mark), ALLOC_OK);
+    assert_int_equal(pool->num_allocs, 2);
+    assert_int_equal(pool->num_gaps, 1);
+
+    mem_inspect_pool(pool, &segs, &num_segs);
+    assert_int_equal(num_segs, 2);
+    assert_int_equal(segs[0].size, 300);
+    assert_int_equal(segs[0].allocated, 1);
+    assert_int_equal(segs[1].size, 700);
+    assert_int_equal(segs[1].allocated, 0);
+    free(segs);
+
+    // the next allocation reuses the released space
+    void *c = mem_new_alloc(pool, 50);
+    assert_true(c == pool->mem + 300);
+
+    // can't release to a mark that's already gone
+    pool_mark_t later = mem_pool_mark(pool);
+    assert_int_equal(mem_pool_release_to_mark(pool, mark), ALLOC_OK);
+    assert_int_equal(mem_pool_release_to_mark(pool, later), ALLOC_FAIL);
+    assert_int_equal(mem_del_alloc(pool, c), ALLOC_FAIL);
+
+    assert_int_equal(mem_del_alloc(pool, b), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+    assert_int_equal(mem_del_alloc(pool, a), ALLOC_OK);
+    assert_int_equal(pool->alloc_size, 0);
+    assert_true(mem_new_alloc(pool, 10) == pool->mem);
+    assert_int_equal(mem_pool_reset(pool), ALLOC_OK);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+/*******************************************/
+/***          14. SLAB POOLS             ***/
+/*******************************************/
+
+void test_pool_slab0(void **state) {
+    (void) state; /* unused */
+
+    const unsigned count = 100;
+    const size_t object_size = 48;
+    void *objects[count];
+    pool_segment_pt segs = NULL;
+    unsigned num_segs = 0;
+
+    /*
+     * Fixed-size objects:
+     *
+     * 1. Allocate every object, laid out back to back; then the slab is full.
+     * 2. Free two neighbours and one more, shown as two gaps.
+     * 3. Freed objects are reused; bad and double frees fail.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    assert_null(mem_pool_open(POOL_SIZE, SLAB));
+    assert_null(mem_slab_open(0, count));
+
+    pool_pt pool = mem_slab_open(object_size, count);
+    assert_non_null(pool);
+    assert_int_equal(pool->policy, SLAB);
+    assert_int_equal(pool->total_size, count * object_size);
+    assert_int_equal(pool->num_gaps, 1);
+
+    assert_null(mem_new_alloc(pool, object_size + 1));
+    for (unsigned i = 0; i < count; ++i) {
+        objects[i] = mem_new_alloc(pool, 1 + i % object_size);
+        assert_true((char *) objects[i] == pool->mem + i * object_size);
+    }
+    assert_null(mem_new_alloc(pool, 1));
+    assert_int_equal(pool->num_allocs, count);
+    assert_int_equal(pool->num_gaps, 0);
+
+    assert_int_equal(mem_del_alloc(pool, objects[10]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, objects[11]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, objects[50]), ALLOC_OK);
+    assert_int_equal(pool->num_gaps, 2);
+
+    mem_inspect_pool(pool, &segs, &num_segs);
+    assert_int_equal(num_segs, 5);
+    assert_int_equal(segs[0].size, 10 * object_size);
+    assert_int_equal(segs[0].allocated, 1);
+    assert_int_equal(segs[1].size, 2 * object_size);
+    assert_int_equal(segs[1].allocated, 0);
+    assert_int_equal(segs[3].size, object_size);
+    assert_int_equal(segs[3].allocated, 0);
+    free(segs);
+
+    assert_int_equal(mem_del_alloc(pool, objects[50]), ALLOC_FAIL);
+    assert_int_equal(mem_del_alloc(pool, (char *) objects[20] + 1), ALLOC_FAIL);
+
+    // the last object freed is the first reused
+    assert_true(mem_new_alloc(pool, object_size) == objects[50]);
+    assert_true(mem_new_alloc(pool, object_size) == objects[11]);
+    assert_int_equal(pool->num_gaps, 1);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+    assert_int_equal(mem_pool_reset(pool), ALLOC_OK);
+    assert_int_equal(pool->num_allocs, 0);
+    assert_true(mem_new_alloc(pool, object_size) == pool->mem);
+    assert_int_equal(mem_del_alloc(pool, pool->mem), ALLOC_OK);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+/*******************************************/
+/***          15. BUDDY POOLS            ***/
+/*******************************************/
+
+void test_pool_buddy0(void **state) {
+    (void) state; /* unused */
+
+    const size_t unit = 16;
+    pool_segment_pt segs = NULL;
+    unsigned num_segs = 0;
+
+    /*
+     * Power-of-two blocks:
+     *
+     * 1. Open a pool of 62 units (1000 bytes rounded down), which starts
+     *    out as blocks of 32, 16, 8, 4 and 2 units.
+     * 2. Allocate three 100-byte (8-unit) blocks, from the smallest blocks
+     *    that fit, splitting the 16-unit block for two of them.
+     * 3. Free the two buddies, which merge back into 16 units.
+     * 4. Bad and double frees fail; the largest block is 32 units.
+     * 5. Reset, and small requests come from the 2-unit block.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open(1000, BUDDY);
+    assert_non_null(pool);
+    assert_int_equal(pool->policy, BUDDY);
+    assert_int_equal(pool->total_size, 62 * unit);
+    assert_int_equal(pool->num_gaps, 1);
+    assert_int_equal(mem_pool_cache_enable(pool), ALLOC_FAIL);
+
+    char *a = mem_new_alloc(pool, 100);
+    char *b = mem_new_alloc(pool, 100);
+    char *c = mem_new_alloc(pool, 100);
+    assert_true(a == pool->mem + 48 * unit);
+    assert_true(b == pool->mem + 32 * unit);
+    assert_true(c == pool->mem + 40 * unit);
+    assert_int_equal(pool->num_allocs, 3);
+    assert_int_equal(pool->alloc_size, 3 * 8 * unit);
+    assert_int_equal(pool->num_gaps, 2);
+
+    mem_inspect_pool(pool, &segs, &num_segs);
+    assert_int_equal(num_segs, 5);
+    assert_int_equal(segs[0].size, 32 * unit);
+    assert_int_equal(segs[0].allocated, 0);
+    assert_int_equal(segs[1].size, 8 * unit);
+    assert_int_equal(segs[1].allocated, 1);
+    assert_int_equal(segs[4].size, 6 * unit);
+    assert_int_equal(segs[4].allocated, 0);
+    free(segs);
+
+    assert_int_equal(mem_del_alloc(pool, b), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, c), ALLOC_OK);
+    assert_int_equal(pool->num_gaps, 2);
+
+    mem_inspect_pool(pool, &segs, &num_segs);
+    assert_int_equal(num_segs, 3);
+    assert_int_equal(segs[0].size, 48 * unit);
+    assert_int_equal(segs[0].allocated, 0);
+    free(segs);
+
+    // b is now the start of a free 16-unit block
+    assert_int_equal(mem_del_alloc(pool, b), ALLOC_FAIL);
+    assert_int_equal(mem_del_alloc(pool, a + unit), ALLOC_FAIL);
+    assert_null(mem_new_alloc(pool, 33 * unit));
+    assert_true(mem_new_alloc(pool, 32 * unit) == pool->mem);
+
+    assert_int_equal(mem_pool_reset(pool), ALLOC_OK);
+    assert_int_equal(pool->num_allocs, 0);
+    assert_int_equal(pool->num_gaps, 1);
+
+    const size_t sizes[] = { 1, unit };
+    void *out[2];
+    assert_int_equal(mem_new_alloc_batch(pool, sizes, 2, out), ALLOC_OK);
+    assert_true(out[0] == pool->mem + 60 * unit);
+    assert_true(out[1] == pool->mem + 61 * unit);
+    assert_int_equal(mem_del_alloc_batch(pool, out, 2), ALLOC_OK);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+/*******************************************/
+/***          16. REALLOCATION           ***/
+/*******************************************/
+
+void test_pool_realloc0(void **state) {
+    (void) state; /* unused */
+
+    pool_segment_pt segs = NULL;
+    unsigned num_segs = 0;
+
+    /*
+     * Resizing in place and moving:
+     *
+     * 1. Grow an allocation into the gap after it, then shrink it back,
+     *    both in place.
+     * 2. Shrink an allocation with an allocation after it, which leaves
+     *    a tail gap.
+     * 3. Grow it past that gap, which moves it with its contents.
+     * 4. NULL reallocates as a new allocation and size 0 frees.
+     * 5. A buddy block shrinks in place and can't grow past its order.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+
+    char *a = mem_new_alloc(pool, 100);
+    char *b = mem_new_alloc(pool, 100);
+    memset(a, 'a', 100);
+    memset(b, 'b', 100);
+
+    assert_true(mem_realloc(pool, b, 300) == b);
+    assert_int_equal(pool->alloc_size, 400);
+    assert_int_equal(pool->num_gaps, 1);
+    assert_true(mem_realloc(pool, b, 50) == b);
+    assert_int_equal(pool->alloc_size, 150);
+    assert_int_equal(pool->num_gaps, 1);
+    assert_int_equal(b[49], 'b');
+
+    assert_true(mem_realloc(pool, a, 60) == a);
+    assert_int_equal(pool->num_gaps, 2);
+    mem_inspect_pool(pool, &segs, &num_segs);
+    assert_int_equal(num_segs, 4);
+    assert_int_equal(segs[0].size, 60);
+    assert_int_equal(segs[1].size, 40);
+    assert_int_equal(segs[1].allocated, 0);
+    assert_int_equal(segs[2].size, 50);
+    free(segs);
+
+    // 40 bytes aren't enough to grow by 140, so a moves to the top gap
+    char *moved = mem_realloc(pool, a, 200);
+    assert_true(moved == pool->mem + 150);
+    assert_int_equal(moved[0], 'a');
+    assert_int_equal(moved[59], 'a');
+    assert_int_equal(pool->num_allocs, 2);
+    assert_int_equal(pool->alloc_size, 250);
+    mem_inspect_pool(pool, &segs, &num_segs);
+    assert_int_equal(num_segs, 4);
+    assert_int_equal(segs[0].size, 100);
+    assert_int_equal(segs[0].allocated, 0);
+    free(segs);
+
+    assert_null(mem_realloc(pool, pool->mem + 1, 10));
+    assert_null(mem_realloc(pool, moved, POOL_SIZE));
+    assert_int_equal(moved[0], 'a');
+
+    char *c = mem_realloc(pool, NULL, 10);
+    assert_true(c == pool->mem);
+    assert_null(mem_realloc(pool, c, 0));
+    assert_null(mem_realloc(pool, moved, 0));
+    assert_null(mem_realloc(pool, b, 0));
+    assert_int_equal(pool->num_allocs, 0);
+    assert_int_equal(pool->num_gaps, 1);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open(1024, BUDDY);
+    assert_non_null(pool);
+    char *p = mem_new_alloc(pool, 256);
+    assert_true(mem_realloc(pool, p, 200) == p);
+    assert_int_equal(pool->alloc_size, 256);
+    assert_true(mem_realloc(pool, p, 16) == p);
+    assert_int_equal(pool->alloc_size, 16);
+    assert_int_equal(pool->num_gaps, 1);
+    assert_null(mem_realloc(pool, p, 1024));
+    assert_int_equal(mem_del_alloc(pool, p), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+/*******************************************/
+/***          17. ALIGNED ALLOCATION     ***/
+/*******************************************/
+
+void test_pool_aligned0(void **state) {
+    (void) state; /* unused */
+
+    const size_t alignment = 64;
+    pool_segment_pt segs = NULL;
+    unsigned num_segs = 0;
+
+    /*
+     * Aligned allocation:
+     *
+     * 1. FIRST_FIT: an aligned allocation after a 10-byte one leaves a
+     *    pad gap in front of it, which merges back when it is freed.
+     * 2. BEST_FIT: a 40-byte gap that starts one byte past an alignment
+     *    boundary is skipped for 30 bytes; the 100-byte gap is used.
+     * 3. TLSF and ARENA pools align too; bad alignments fail.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+
+    assert_null(mem_new_alloc_aligned(pool, 100, 0));
+    assert_null(mem_new_alloc_aligned(pool, 100, 48));
+
+    char *a = mem_new_alloc(pool, 10);
+    char *b = mem_new_alloc_aligned(pool, 100, alignment);
+    assert_non_null(b);
+    assert_int_equal((uintptr_t) b % alignment, 0);
+    assert_true(b > a + 10 && b < a + 10 + alignment);
+    assert_int_equal(pool->num_allocs, 2);
+    assert_int_equal(pool->alloc_size, 110);
+    assert_int_equal(pool->num_gaps, 2);
+
+    mem_inspect_pool(pool, &segs, &num_segs);
+    assert_int_equal(num_segs, 4);
+    assert_int_equal(segs[1].size, b - a - 10);
+    assert_int_equal(segs[1].allocated, 0);
+    assert_int_equal(segs[2].size, 100);
+    assert_int_equal(segs[2].allocated, 1);
+    free(segs);
+
+    assert_int_equal(mem_del_alloc(pool, b), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, a), ALLOC_OK);
+    assert_int_equal(pool->num_gaps, 1);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open(POOL_SIZE, BEST_FIT);
+    assert_non_null(pool);
+
+    // put the small gap one byte past a boundary
+    size_t filler = (alignment - (uintptr_t) pool->mem % alignment) % alignment + 1;
+    void *allocs[4];
+    allocs[0] = mem_new_alloc(pool, filler);
+    char *small = mem_new_alloc(pool, 40);
+    allocs[1] = mem_new_alloc(pool, 1);
+    char *large = mem_new_alloc(pool, 100);
+    allocs[2] = mem_new_alloc(pool, 1);
+    assert_int_equal((uintptr_t) small % alignment, 1);
+    assert_int_equal(mem_del_alloc(pool, small), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, large), ALLOC_OK);
+
+    char *c = mem_new_alloc_aligned(pool, 30, alignment);
+    assert_int_equal((uintptr_t) c % alignment, 0);
+    assert_true(c > large && c + 30 <= large + 100);
+    assert_int_equal(pool->num_gaps, 4);
+
+    allocs[3] = c;
+    assert_int_equal(mem_del_alloc_batch(pool, allocs, 4), ALLOC_OK);
+    assert_int_equal(pool->num_gaps, 1);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open(POOL_SIZE, TLSF);
+    assert_non_null(pool);
+    a = mem_new_alloc(pool, 3);
+    b = mem_new_alloc_aligned(pool, 100, 256);
+    assert_int_equal((uintptr_t) b % 256, 0);
+    assert_int_equal(mem_del_alloc(pool, b), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, a), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open(POOL_SIZE, ARENA);
+    assert_non_null(pool);
+    a = mem_new_alloc(pool, 3);
+    b = mem_new_alloc_aligned(pool, 8, 32);
+    assert_int_equal((uintptr_t) b % 32, 0);
+    assert_int_equal(pool->alloc_size, b + 8 - pool->mem);
+    assert_int_equal(mem_del_alloc(pool, b), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, a), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+/*******************************************/
+/***          18. POOL MEMORY            ***/
+/*******************************************/
+
+void test_pool_backing0(void **state) {
+    (void) state; /* unused */
+
+    const size_t huge_page = 2 * 1024 * 1024;
+    const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+
+    /*
+     * Where the pool memory comes from:
+     *
+     * 1. POOL_MMAP gives a page-aligned mapping that works like any pool.
+     * 2. POOL_HUGE_PAGES falls back to normal pages if it has to; if it
+     *    got huge pages, the pool is aligned to one.
+     * 3. An impossible size fails cleanly, malloc-ed or mapped.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open_flags(POOL_SIZE, FIRST_FIT, POOL_MMAP);
+    assert_non_null(pool);
+    assert_int_equal(pool->flags, POOL_MMAP);
+    assert_int_equal((uintptr_t) pool->mem % page, 0);
+    char *a = mem_new_alloc(pool, POOL_SIZE / 2);
+    assert_true(a == pool->mem);
+    memset(a, 0x5a, POOL_SIZE / 2);
+    assert_int_equal(mem_del_alloc(pool, a), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open(POOL_SIZE, BEST_FIT);
+    assert_non_null(pool);
+    assert_int_equal(pool->flags, POOL_DEFAULT);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open_flags(2 * huge_page, BUDDY, POOL_HUGE_PAGES);
+    assert_non_null(pool);
+    assert_true(pool->flags & POOL_MMAP);
+    if (pool->flags & POOL_HUGE_PAGES)
+        assert_int_equal((uintptr_t) pool->mem % huge_page, 0);
+    a = mem_new_alloc(pool, huge_page);
+    assert_non_null(a);
+    memset(a, 0x5a, huge_page);
+    assert_int_equal(mem_del_alloc(pool, a), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_null(mem_pool_open(SIZE_MAX / 2, FIRST_FIT));
+    assert_null(mem_pool_open_flags(SIZE_MAX / 2, FIRST_FIT, POOL_MMAP));
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+/*******************************************/
+/***          19. TRIMMING               ***/
+/*******************************************/
+
+void test_pool_trim0(void **state) {
+    (void) state; /* unused */
+
+    const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+
+    /*
+     * Giving gaps back to the OS:
+     *
+     * 1. Free a 32-page allocation between two small ones and trim: the
+     *    whole pages inside both gaps are given back, the allocations
+     *    keep their contents, and trimming again changes nothing.
+     * 2. Allocating over trimmed pages takes them off the count, and
+     *    they read as zeros.
+     * 3. A buddy pool keeps the pages with free list links.
+     * 4. Pools that aren't mapped can't be trimmed.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open_flags(64 * page, FIRST_FIT, POOL_MMAP);
+    assert_non_null(pool);
+    assert_int_equal(pool->trimmed_size, 0);
+
+    char *a = mem_new_alloc(pool, 100);
+    char *big = mem_new_alloc(pool, 32 * page);
+    char *c = mem_new_alloc(pool, 100);
+    memset(a, 'a', 100);
+    memset(big, 'x', 32 * page);
+    memset(c, 'c', 100);
+    assert_int_equal(mem_del_alloc(pool, big), ALLOC_OK);
+
+    assert_int_equal(mem_pool_trim(pool), ALLOC_OK);
+    assert_int_equal(pool->trimmed_size, 62 * page);
+    assert_int_equal(a[99], 'a');
+    assert_int_equal(c[0], 'c');
+    assert_int_equal(mem_pool_trim(pool), ALLOC_OK);
+    assert_int_equal(pool->trimmed_size, 62 * page);
+
+    big = mem_new_alloc(pool, 32 * page);
+    assert_true(big == a + 100);
+    assert_int_equal(pool->trimmed_size, 31 * page);
+#ifdef __linux__
+    assert_int_equal(big[page], 0);
+    assert_int_equal(big[31 * page - 100], 0);
+#endif
+    assert_int_equal(big[0], 'x');
+
+    assert_int_equal(mem_del_alloc(pool, big), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, a), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, c), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open_flags(16 * page, BUDDY, POOL_MMAP);
+    assert_non_null(pool);
+    assert_int_equal(mem_pool_trim(pool), ALLOC_OK);
+    assert_int_equal(pool->trimmed_size, 15 * page);
+
+    // splitting down to one byte writes links at pages 8, 4, 2 and 1
+    a = mem_new_alloc(pool, 1);
+    assert_true(a == pool->mem);
+    assert_int_equal(pool->trimmed_size, 11 * page);
+    assert_int_equal(mem_del_alloc(pool, a), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    assert_int_equal(mem_pool_trim(pool), ALLOC_FAIL);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+/*******************************************/
+/***          20. LAZY COMMIT            ***/
+/*******************************************/
+
+void test_pool_lazy0(void **state) {
+    (void) state; /* unused */
+
+    const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    const size_t reserve = (size_t) 1 << 30;
+    const unsigned num_pools = 200;
+    pool_pt pools[num_pools];
+
+    /*
+     * Reserve-then-commit pools:
+     *
+     * 1. A 1GB lazy pool starts with nothing committed; a small
+     *    allocation commits one 16-page chunk, a 64-page one the pages
+     *    it reaches.
+     * 2. Trimming only counts pages that were committed.
+     * 3. 200 lazy 5MB pools open and close without committing anything.
+     * 4. Buddy pools commit their links and blocks as they go.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open_flags(reserve, FIRST_FIT, POOL_LAZY_COMMIT);
+    assert_non_null(pool);
+    assert_int_equal(pool->flags, POOL_MMAP | POOL_LAZY_COMMIT);
+    assert_int_equal(pool->committed_size, 0);
+
+    char *a = mem_new_alloc(pool, 100);
+    memset(a, 'a', 100);
+    assert_int_equal(pool->committed_size, 16 * page);
+
+    char *b = mem_new_alloc(pool, 64 * page);
+    memset(b, 'b', 64 * page);
+    assert_int_equal(pool->committed_size, 65 * page);
+
+    assert_int_equal(mem_del_alloc(pool, b), ALLOC_OK);
+    assert_int_equal(mem_pool_trim(pool), ALLOC_OK);
+    assert_int_equal(pool->trimmed_size, 64 * page);
+    assert_int_equal(a[99], 'a');
+
+    assert_int_equal(mem_del_alloc(pool, a), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    for (unsigned i = 0; i < num_pools; ++i) {
+        pools[i] = mem_pool_open_flags(POOL_SIZE * 5, BEST_FIT, POOL_LAZY_COMMIT);
+        assert_non_null(pools[i]);
+        assert_int_equal(pools[i]->committed_size, 0);
+    }
+    for (unsigned i = 0; i < num_pools; ++i) {
+        assert_int_equal(mem_pool_close(pools[i]), ALLOC_OK);
+    }
+
+    pool = mem_pool_open_flags(256 * page, BUDDY, POOL_LAZY_COMMIT);
+    assert_non_null(pool);
+    a = mem_new_alloc(pool, 100 * page);
+    assert_non_null(a);
+    memset(a, 'a', 100 * page);
+    assert_true(pool->committed_size < pool->total_size);
+    b = mem_new_alloc(pool, 1);
+    *b = 'b';
+    assert_int_equal(mem_del_alloc(pool, a), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, b), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+/*******************************************/
+/***          21. PREFAULTING            ***/
+/*******************************************/
+
+static long minor_faults() {
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+void test_pool_prefault0(void **state) {
+    (void) state; /* unused */
+
+    const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    const size_t size = 1024 * page;
+    const unsigned flags[] = { POOL_MMAP | POOL_PREFAULT, POOL_PREFAULT };
+    const unsigned num_flags = sizeof(flags) / sizeof(flags[0]);
+
+    /*
+     * Pre-faulted and locked pools:
+     *
+     * 1. A plain pool spends no time pre-faulting.
+     * 2. Pre-faulted pools are always mapped, and report the time it
+     *    took; filling an allocation of the whole pool takes (next to)
+     *    no page faults, last page included.
+     * 3. POOL_PREFAULT overrides POOL_LAZY_COMMIT.
+     * 4. A POOL_LOCK pool is pre-faulted and locked, so it can't be
+     *    trimmed, or isn't opened at all if RLIMIT_MEMLOCK won't allow it.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open_flags(size, FIRST_FIT, POOL_MMAP);
+    assert_non_null(pool);
+    assert_int_equal(pool->prefault_ns, 0);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    for (unsigned i = 0; i < num_flags; ++i) {
+        pool = mem_pool_open_flags(size, FIRST_FIT, flags[i]);
+        assert_non_null(pool);
+        assert_true(pool->flags & POOL_MMAP);
+        assert_true(pool->flags & POOL_PREFAULT);
+        assert_true(pool->prefault_ns > 0);
+
+        long faults = minor_faults();
+        char *a = mem_new_alloc(pool, size);
+        assert_true(a == pool->mem);
+        memset(a, 'a', size);
+        // not 0, as sanitizer shadow memory takes faults of its own
+        assert_true(minor_faults() - faults < (long) (size / page / 4));
+
+        assert_int_equal(mem_del_alloc(pool, a), ALLOC_OK);
+        assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    }
+
+    pool = mem_pool_open_flags(size, BEST_FIT, POOL_LAZY_COMMIT | POOL_PREFAULT);
+    assert_non_null(pool);
+    assert_int_equal(pool->flags & POOL_LAZY_COMMIT, 0);
+    assert_int_equal(pool->committed_size, size);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    struct rlimit limit;
+    assert_int_equal(getrlimit(RLIMIT_MEMLOCK, &limit), 0);
+
+    // CAP_IPC_LOCK lifts the limit, so it only explains a failure
+    pool = mem_pool_open_flags(size, BUDDY, POOL_LOCK);
+    if (pool == NULL) {
+        assert_true(limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < size);
+        assert_int_equal(mem_free(), ALLOC_OK);
+        return;
+    }
+    assert_non_null(pool);
+    assert_true(pool->flags & POOL_PREFAULT);
+    assert_true(pool->flags & POOL_LOCK);
+    assert_int_equal(mem_pool_trim(pool), ALLOC_FAIL);
+
+    char *a = mem_new_alloc(pool, 100);
+    assert_non_null(a);
+    memset(a, 'a', 100);
+    assert_int_equal(mem_del_alloc(pool, a), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+/*******************************************/
+/***          22. BENCHMARKS             ***/
+/*******************************************/
+
+static void test_pool_bf_lookup_bench(void **state) {
+    (void) state; /* unused */
+
+    const unsigned num_gaps[] = { 1000, 10000, 100000 };
+    const unsigned num_lookups = 20000;
+    const unsigned max_size = 512;
+
+    /*
+     * Best-fit lookup time against gap count:
+     *
+     * 1. Allocate 2 x num_gaps blocks of varying size.
+     * 2. Deallocate every other one, leaving num_gaps gaps between allocations.
+     * 3. Time allocate/deallocate pairs which each have to find a best fit.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    for (unsigned n = 0; n < sizeof(num_gaps) / sizeof(num_gaps[0]); ++n) {
+        unsigned num_allocs = 2 * num_gaps[n];
+        size_t pool_size = (size_t) num_allocs * max_size + max_size;
+
+        pool_pt pool = mem_pool_open(pool_size, BEST_FIT);
+        assert_non_null(pool);
+
+        void **allocs = calloc(num_allocs, sizeof(void *));
+        assert_non_null(allocs);
+
+        for (unsigned aix = 0; aix < num_allocs; ++aix) {
+            allocs[aix] = mem_new_alloc(pool, 1 + (aix * 7919) % max_size);
+            assert_non_null(allocs[aix]);
+        }
+        for (unsigned aix = 1; aix < num_allocs; aix += 2) {
+            assert_int_equal(mem_del_alloc(pool, allocs[aix]), ALLOC_OK);
+            allocs[aix] = NULL;
+        }
+        // the last one merges with the trailing gap
+        assert_int_equal(pool->num_gaps, num_gaps[n]);
+
+        clock_t start = clock();
+        for (unsigned l = 0; l < num_lookups; ++l) {
+            void *alloc = mem_new_alloc(pool, 1 + (l * 104729) % max_size);
+            assert_non_null(alloc);
+            assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+        }
+        double elapsed = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+        INFO("%7u gaps: %8.1f ns per best-fit alloc/dealloc\n",
+             num_gaps[n], elapsed * 1e9 / num_lookups);
+
+        for (unsigned aix = 0; aix < num_allocs; aix += 2) {
+            assert_int_equal(mem_del_alloc(pool, allocs[aix]), ALLOC_OK);
+        }
+        free(allocs);
+
+        assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    }
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_metadata_bench(void **state) {
+    (void) state; /* unused */
+
+    const unsigned num_allocs = 100000;
+    const size_t alloc_size = 16;
+
+#ifdef MEM_POOL_COMPACT
+    const char *layout = "compact";
+#else
+    const char *layout = "default";
+#endif
+
+    /*
+     * Metadata footprint against segment count:
+     *
+     * 1. Fill a pool with num_allocs small allocations.
+     * 2. Report the bookkeeping bytes per segment, for the node layout
+     *    of this build (build with and without MEM_POOL_COMPACT to
+     *    compare the two).
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open(num_allocs * alloc_size, FIRST_FIT);
+    assert_non_null(pool);
+
+    size_t empty = mem_inspect_metadata(pool);
+    assert_true(empty > 0);
+
+    void **allocs = calloc(num_allocs, sizeof(void *));
+    assert_non_null(allocs);
+
+    for (unsigned aix = 0; aix < num_allocs; ++aix) {
+        allocs[aix] = mem_new_alloc(pool, alloc_size);
+        assert_non_null(allocs[aix]);
+    }
+    assert_int_equal(pool->num_allocs, num_allocs);
+
+    size_t full = mem_inspect_metadata(pool);
+    assert_true(full > empty);
+
+    INFO("%s layout, %7u segments: %lu metadata bytes, %.1f per segment\n",
+         layout, num_allocs, (unsigned long) full, (double) full / num_allocs);
+
+    for (unsigned aix = 0; aix < num_allocs; ++aix) {
+        assert_int_equal(mem_del_alloc(pool, allocs[aix]), ALLOC_OK);
+    }
+    free(allocs);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_batch_bench(void **state) {
+    (void) state; /* unused */
+
+    const unsigned num_messages = 2000;
+    const unsigned num_buffers = 200;
+    size_t sizes[num_buffers];
+    void *allocs[num_buffers];
+
+    /*
+     * Single vs batch calls, per message:
+     *
+     * 1. Allocate num_buffers small buffers of varying size.
+     * 2. Free them all again.
+     */
+
+    for (unsigned i = 0; i < num_buffers; ++i)
+        sizes[i] = 8 + (i * 37) % 120;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open(POOL_SIZE, BEST_FIT);
+    assert_non_null(pool);
+
+    clock_t start = clock();
+    for (unsigned m = 0; m < num_messages; ++m) {
+        for (unsigned i = 0; i < num_buffers; ++i) {
+            allocs[i] = mem_new_alloc(pool, sizes[i]);
+            assert_non_null(allocs[i]);
+        }
+        for (unsigned i = 0; i < num_buffers; ++i)
+            assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    double single = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+    start = clock();
+    for (unsigned m = 0; m < num_messages; ++m) {
+        assert_int_equal(mem_new_alloc_batch(pool, sizes, num_buffers, allocs), ALLOC_OK);
+        assert_int_equal(mem_del_alloc_batch(pool, allocs, num_buffers), ALLOC_OK);
+    }
+    double batch = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+    INFO("%u buffers: %.1f ns per buffer single, %.1f ns batched\n", num_buffers,
+         single * 1e9 / (num_messages * num_buffers), batch * 1e9 / (num_messages * num_buffers));
+
+    assert_int_equal(pool->num_gaps, 1);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_slab_bench(void **state) {
+    (void) state; /* unused */
+
+    const unsigned count = 100000;
+    const size_t object_size = 64;
+    const unsigned num_rounds = 10;
+    void **objects = calloc(count, sizeof(void *));
+    assert_non_null(objects);
+
+    /*
+     * Fixed-size records, slab vs best fit:
+     *
+     * 1. Fill the pool with count records and free them all, num_rounds times.
+     * 2. Report the time per alloc/free and the metadata per record.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pools[2];
+    pools[0] = mem_pool_open(count * object_size, BEST_FIT);
+    pools[1] = mem_slab_open(object_size, count);
+    assert_non_null(pools[0]);
+    assert_non_null(pools[1]);
+
+    for (unsigned p = 0; p < 2; ++p) {
+        size_t metadata = 0;
+
+        clock_t start = clock();
+        for (unsigned r = 0; r < num_rounds; ++r) {
+            for (unsigned i = 0; i < count; ++i) {
+                objects[i] = mem_new_alloc(pools[p], object_size);
+                assert_non_null(objects[i]);
+            }
+            metadata = mem_inspect_metadata(pools[p]);
+            for (unsigned i = 0; i < count; ++i)
+                assert_int_equal(mem_del_alloc(pools[p], objects[i]), ALLOC_OK);
+        }
+        double elapsed = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+        INFO("%s: %.1f ns per alloc/free, %.2f metadata bytes per record\n",
+             p ? "slab    " : "best-fit", elapsed * 1e9 / (num_rounds * count),
+             (double) metadata / count);
+
+        assert_int_equal(mem_pool_close(pools[p]), ALLOC_OK);
+    }
+
+    free(objects);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+/*******************************************/
+/***        23. DRIVER ROUTINE           ***/
+/*******************************************/
+
+int run_test_suite() {
+    const struct CMUnitTest tests[] = {
+            // General tests
+            cmocka_unit_test(test_pool_store_smoketest),
+            cmocka_unit_test(test_pool_smoketest),
+
+            cmocka_unit_test(test_pool_nonempty),
+
+            cmocka_unit_test_setup_teardown(test_pool_ff_metadata, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_bf_metadata, pool_bf_setup, pool_bf_teardown),
+
+            // First-fit tests
+            cmocka_unit_test_setup_teardown(test_pool_scenario00, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario01, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario02, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario03, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario04, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario05, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario06, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario07, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario08, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario09, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario10, pool_ff_setup, pool_ff_teardown),
+
+            // Best-fit tests
+            cmocka_unit_test_setup_teardown(test_pool_scenario11, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario12, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario13, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario14, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario15, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario16, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario17, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario18, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario19, pool_bf_setup, pool_bf_teardown),
+
+            // TLSF tests
+            cmocka_unit_test_setup_teardown(test_pool_scenario20, pool_tlsf_setup, pool_tlsf_teardown),
+
+            // Next-fit tests
+            cmocka_unit_test_setup_teardown(test_pool_scenario21, pool_nf_setup, pool_nf_teardown),
+
+            // Stress tests
+            cmocka_unit_test(test_pool_stresstest0),
+
+#ifdef MEM_POOL_THREAD_SAFE
+            // Thread-safety tests
+            cmocka_unit_test(test_pool_threads0),
+            cmocka_unit_test(test_pool_threads1),
+            cmocka_unit_test(test_pool_threads2),
+            cmocka_unit_test(test_pool_threads3),
+#endif
+
+            // Thread cache tests
+            cmocka_unit_test(test_pool_cache0),
+            cmocka_unit_test(test_pool_cache1),
+            cmocka_unit_test(test_pool_cache2),
+
+            // Sharded pool tests
+            cmocka_unit_test(test_pool_sharded0),
+
+            // Batch API tests
+            cmocka_unit_test(test_pool_batch0),
+
+            // Reset tests
+            cmocka_unit_test(test_pool_reset0),
+
+            // Arena tests
+            cmocka_unit_test(test_pool_arena0),
+
+            // Slab tests
+            cmocka_unit_test(test_pool_slab0),
+
+            // Buddy tests
+            cmocka_unit_test(test_pool_buddy0),
+
+            // Reallocation tests
+            cmocka_unit_test(test_pool_realloc0),
+
+            // Aligned allocation tests
+            cmocka_unit_test(test_pool_aligned0),
+
+            // Pool memory tests
+            cmocka_unit_test(test_pool_backing0),
+
+            // Trimming tests
+            cmocka_unit_test(test_pool_trim0),
+
+            // Lazy commit tests
+            cmocka_unit_test(test_pool_lazy0),
+
+            // Prefault tests
+            cmocka_unit_test(test_pool_prefault0),
+
+            // Benchmarks
+            cmocka_unit_test(test_pool_bf_lookup_bench),
+            cmocka_unit_test(test_pool_metadata_bench),
+            cmocka_unit_test(test_pool_batch_bench),
+            cmocka_unit_test(test_pool_slab_bench),
     };
 
     return cmocka_run_group_tests_name("pool_test_suite", tests, NULL, NULL);